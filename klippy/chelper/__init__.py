@@ -18,7 +18,8 @@ COMPILE_ARGS = ("-Wall -g -O2 -shared -fPIC"
 SSE_FLAGS = "-mfpmath=sse -msse2"
 SOURCE_FILES = [
     'pyhelper.c', 'serialqueue.c', 'stepcompress.c', 'itersolve.c', 'trapq.c',
-    'pollreactor.c', 'msgblock.c', 'trdispatch.c',
+    'pollreactor.c', 'msgblock.c', 'trdispatch.c', 'gcodeparse.c',
+    'bulkdata.c',
     'kin_cartesian.c', 'kin_corexy.c', 'kin_corexz.c', 'kin_delta.c',
     'kin_deltesian.c', 'kin_polar.c', 'kin_rotary_delta.c', 'kin_winch.c',
     'kin_extruder.c', 'kin_shaper.c',
@@ -38,7 +39,8 @@ defs_stepcompress = """
 
     struct stepcompress *stepcompress_alloc(uint32_t oid);
     void stepcompress_fill(struct stepcompress *sc, uint32_t max_error
-        , int32_t queue_step_msgtag, int32_t set_next_step_dir_msgtag);
+        , int32_t queue_step_msgtag, int32_t set_next_step_dir_msgtag
+        , int32_t queue_step_delta_msgtag);
     void stepcompress_set_invert_sdir(struct stepcompress *sc
         , uint32_t invert_sdir);
     void stepcompress_free(struct stepcompress *sc);
@@ -154,16 +156,16 @@ defs_kin_shaper = """
 """
 
 defs_serialqueue = """
-    #define MESSAGE_MAX 64
+    #define MESSAGE_BLOCK_MAX 255
     struct pull_queue_message {
-        uint8_t msg[MESSAGE_MAX];
+        uint8_t msg[MESSAGE_BLOCK_MAX];
         int len;
         double sent_time, receive_time;
         uint64_t notify_id;
     };
 
     struct serialqueue *serialqueue_alloc(int serial_fd, char serial_fd_type
-        , int client_id);
+        , int client_id, int use_shared_thread);
     void serialqueue_exit(struct serialqueue *sq);
     void serialqueue_free(struct serialqueue *sq);
     struct command_queue *serialqueue_alloc_commandqueue(void);
@@ -177,14 +179,30 @@ defs_serialqueue = """
         , double frequency);
     void serialqueue_set_receive_window(struct serialqueue *sq
         , int receive_window);
+    void serialqueue_set_block_max(struct serialqueue *sq, int block_max);
+    void serialqueue_set_extended_seq(struct serialqueue *sq, int selective);
+    void serialqueue_set_thread_params(struct serialqueue *sq, int cpu
+        , int priority);
     void serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
         , double conv_time, uint64_t conv_clock, uint64_t last_clock);
     void serialqueue_get_stats(struct serialqueue *sq, char *buf, int len);
     int serialqueue_extract_old(struct serialqueue *sq, int sentq
         , struct pull_queue_message *q, int max);
+
+    struct msgparser *msgparser_alloc(void);
+    void msgparser_free(struct msgparser *mp);
+    int msgparser_add_format(struct msgparser *mp, int msgid
+        , char *param_types);
+    int msgparser_parse(struct msgparser *mp, uint8_t *msg, int msg_len
+        , int64_t *params);
 """
 
 defs_trdispatch = """
+    struct pull_trdispatch_stats {
+        double srtt, rttvar, max_report_gap;
+        uint64_t trigger_clock;
+    };
+
     void trdispatch_start(struct trdispatch *td, uint32_t dispatch_reason);
     void trdispatch_stop(struct trdispatch *td);
     struct trdispatch *trdispatch_alloc(void);
@@ -195,6 +213,48 @@ defs_trdispatch = """
     void trdispatch_mcu_setup(struct trdispatch_mcu *tdm
         , uint64_t last_status_clock, uint64_t expire_clock
         , uint64_t expire_ticks, uint64_t min_extend_ticks);
+    void trdispatch_mcu_get_stats(struct trdispatch_mcu *tdm
+        , struct pull_trdispatch_stats *stats);
+"""
+
+defs_bulkdata = """
+    #define MESSAGE_PAYLOAD_MAX 59
+    struct bulkdata_block {
+        uint64_t sequence;
+        double receive_time;
+        uint32_t data_len;
+        uint8_t data[MESSAGE_PAYLOAD_MAX];
+    };
+
+    struct bulkdata *bulkdata_alloc(struct serialqueue *sq
+        , uint32_t data_msgtag, uint32_t oid, uint32_t max_blocks);
+    void bulkdata_free(struct bulkdata *bd);
+    void bulkdata_start(struct bulkdata *bd);
+    void bulkdata_stop(struct bulkdata *bd);
+    int bulkdata_pull(struct bulkdata *bd, struct bulkdata_block *blocks
+        , int max);
+    uint32_t bulkdata_get_overflows(struct bulkdata *bd);
+"""
+
+defs_gcodeparse = """
+    struct gcode_move {
+        double params[5];
+        uint32_t flags, length;
+    };
+
+    int gcodeparse_moves(const char *data, int len
+        , struct gcode_move *moves, int max);
+    int gcodeparse_binary_moves(const char *data, int len
+        , struct gcode_move *moves, int max);
+    struct gcode_index *gcodeindex_alloc(void);
+    void gcodeindex_free(struct gcode_index *gi);
+    void gcodeindex_abort(struct gcode_index *gi);
+    int gcodeindex_build(struct gcode_index *gi, int fd, int64_t len);
+    int64_t gcodeindex_get_line_count(struct gcode_index *gi);
+    int64_t gcodeindex_line_to_offset(struct gcode_index *gi
+        , const char *data, int64_t line);
+    int64_t gcodeindex_offset_to_line(struct gcode_index *gi
+        , const char *data, int64_t offset);
 """
 
 defs_pyhelper = """
@@ -208,7 +268,8 @@ defs_std = """
 
 defs_all = [
     defs_pyhelper, defs_serialqueue, defs_std, defs_stepcompress,
-    defs_itersolve, defs_trapq, defs_trdispatch,
+    defs_itersolve, defs_trapq, defs_trdispatch, defs_bulkdata,
+    defs_gcodeparse,
     defs_kin_cartesian, defs_kin_corexy, defs_kin_corexz, defs_kin_delta,
     defs_kin_deltesian, defs_kin_polar, defs_kin_rotary_delta, defs_kin_winch,
     defs_kin_extruder, defs_kin_shaper,
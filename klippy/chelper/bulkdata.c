@@ -0,0 +1,173 @@
+// Collection of high rate sensor data messages
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// Sensors such as accelerometers and angle sensors send a continuous
+// stream of "<name>_data oid=%c sequence=%hu data=%*s" messages.  This
+// code captures those messages in the serialqueue background thread
+// (via a fastreader) and stores them in a preallocated ring buffer so
+// that the host code can process them in large batches.
+
+#include <pthread.h> // pthread_mutex_lock
+#include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "list.h" // container_of
+#include "pyhelper.h" // get_monotonic
+#include "serialqueue.h" // serialqueue_add_fastreader
+
+struct bulkdata_block {
+    uint64_t sequence;
+    double receive_time;
+    uint32_t data_len;
+    uint8_t data[MESSAGE_PAYLOAD_MAX];
+};
+
+struct bulkdata {
+    struct fastreader fr;
+    struct serialqueue *sq;
+    struct msgparser *mp;
+
+    pthread_mutex_t lock; // protects variables below
+    struct bulkdata_block *blocks;
+    uint32_t max_blocks, first_block, block_count;
+    uint64_t last_sequence;
+    uint32_t overflows;
+};
+
+// Handle a sensor data message (callback from serialqueue fastreader)
+static void
+handle_bulk_data(struct fastreader *fr, uint8_t *data, int len)
+{
+    struct bulkdata *bd = container_of(fr, struct bulkdata, fr);
+
+    // Parse: <name>_data oid=%c sequence=%hu data=%*s
+    int64_t params[3];
+    if (msgparser_parse(bd->mp, data, len, params) < 0)
+        return;
+    uint32_t data_offset = params[2] & 0xffff, data_len = params[2] >> 16;
+    double receive_time = get_monotonic();
+
+    pthread_mutex_lock(&bd->lock);
+    // Extend the 16bit sequence (messages arrive in order)
+    uint64_t seq = (bd->last_sequence & ~0xffffULL) | (uint16_t)params[1];
+    if (seq < bd->last_sequence)
+        seq += 0x10000;
+    bd->last_sequence = seq;
+    if (bd->block_count >= bd->max_blocks) {
+        bd->overflows++;
+        pthread_mutex_unlock(&bd->lock);
+        return;
+    }
+    uint32_t pos = bd->first_block + bd->block_count;
+    if (pos >= bd->max_blocks)
+        pos -= bd->max_blocks;
+    struct bulkdata_block *b = &bd->blocks[pos];
+    b->sequence = seq;
+    b->receive_time = receive_time;
+    b->data_len = data_len;
+    memcpy(b->data, &data[data_offset], data_len);
+    bd->block_count++;
+    pthread_mutex_unlock(&bd->lock);
+}
+
+// Create a new 'struct bulkdata' object
+struct bulkdata * __visible
+bulkdata_alloc(struct serialqueue *sq, uint32_t data_msgtag, uint32_t oid
+               , uint32_t max_blocks)
+{
+    struct bulkdata *bd = malloc(sizeof(*bd));
+    memset(bd, 0, sizeof(*bd));
+    bd->blocks = malloc(max_blocks * sizeof(*bd->blocks));
+    bd->mp = msgparser_alloc();
+    if (!bd->blocks || !bd->mp || !max_blocks)
+        goto fail;
+    // The message id is the low 7 bits of the (vlq encoded) msgtag
+    if (msgparser_add_format(bd->mp, data_msgtag & 0x7f, "uus"))
+        goto fail;
+    int ret = pthread_mutex_init(&bd->lock, NULL);
+    if (ret) {
+        report_errno("bulkdata_alloc", ret);
+        goto fail;
+    }
+    bd->sq = sq;
+    bd->max_blocks = max_blocks;
+
+    // Setup fastreader to match data messages for this oid
+    uint32_t data_prefix[] = {data_msgtag, oid};
+    struct queue_message *dummy = message_alloc_and_encode(
+        data_prefix, ARRAY_SIZE(data_prefix));
+    memcpy(bd->fr.prefix, dummy->msg, dummy->len);
+    bd->fr.prefix_len = dummy->len;
+    free(dummy);
+    bd->fr.func = handle_bulk_data;
+    bd->fr.exclusive = 1;
+
+    return bd;
+fail:
+    msgparser_free(bd->mp);
+    free(bd->blocks);
+    free(bd);
+    return NULL;
+}
+
+// Free memory associated with a 'struct bulkdata' object.  The object
+// must not be active (bulkdata_stop() must have been called).
+void __visible
+bulkdata_free(struct bulkdata *bd)
+{
+    if (!bd)
+        return;
+    pthread_mutex_destroy(&bd->lock);
+    msgparser_free(bd->mp);
+    free(bd->blocks);
+    free(bd);
+}
+
+// Discard any stored data and start collecting messages
+void __visible
+bulkdata_start(struct bulkdata *bd)
+{
+    pthread_mutex_lock(&bd->lock);
+    bd->first_block = bd->block_count = bd->overflows = 0;
+    bd->last_sequence = 0;
+    pthread_mutex_unlock(&bd->lock);
+    serialqueue_add_fastreader(bd->sq, &bd->fr);
+}
+
+// Stop collecting messages
+void __visible
+bulkdata_stop(struct bulkdata *bd)
+{
+    serialqueue_rm_fastreader(bd->sq, &bd->fr);
+}
+
+// Move up to 'max' stored blocks to 'blocks'.  Returns the number of
+// blocks copied.
+int __visible
+bulkdata_pull(struct bulkdata *bd, struct bulkdata_block *blocks, int max)
+{
+    pthread_mutex_lock(&bd->lock);
+    int count = bd->block_count < max ? bd->block_count : max, i;
+    for (i=0; i<count; i++) {
+        blocks[i] = bd->blocks[bd->first_block++];
+        if (bd->first_block >= bd->max_blocks)
+            bd->first_block = 0;
+    }
+    bd->block_count -= count;
+    pthread_mutex_unlock(&bd->lock);
+    return count;
+}
+
+// Return the number of messages discarded due to a full ring buffer
+uint32_t __visible
+bulkdata_get_overflows(struct bulkdata *bd)
+{
+    pthread_mutex_lock(&bd->lock);
+    uint32_t overflows = bd->overflows;
+    pthread_mutex_unlock(&bd->lock);
+    return overflows;
+}
@@ -0,0 +1,390 @@
+// Fast scanning of g-code files (move parsing and line indexing)
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <errno.h> // errno
+#include <stdint.h> // uint32_t
+#include <stdlib.h> // strtod
+#include <string.h> // memcpy
+#include <unistd.h> // pread
+#include "compiler.h" // __visible
+#include "pyhelper.h" // errorf
+
+enum {
+    GP_X = 1<<0, GP_Y = 1<<1, GP_Z = 1<<2, GP_E = 1<<3, GP_F = 1<<4,
+    GP_G0 = 1<<5,
+};
+
+struct gcode_move {
+    double params[5];
+    uint32_t flags, length;
+};
+
+static inline int
+is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline int
+is_value_char(char c)
+{
+    return (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '+';
+}
+
+static inline char
+to_upper(char c)
+{
+    return c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c;
+}
+
+// Parse a numeric parameter value - the full run of value characters
+// must be consumed (so that the result matches Python's float())
+static int
+parse_value(const char *p, const char *end, double *value)
+{
+    char buf[48];
+    int len = end - p;
+    if (!len || len >= sizeof(buf))
+        return -1;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    char *tail;
+    *value = strtod(buf, &tail);
+    if (tail != &buf[len])
+        return -1;
+    return 0;
+}
+
+// Parse a single line starting at 'p' - returns the line length on
+// success, or 0 if the line is not a plain G0/G1 command.  Any line
+// that is not accepted here is left for the full g-code parser.
+static int
+parse_move_line(const char *p, const char *end, struct gcode_move *m)
+{
+    const char *start = p;
+    while (p < end && is_space(*p))
+        p++;
+    if (p + 2 > end || to_upper(p[0]) != 'G' || (p[1] != '0' && p[1] != '1'))
+        return 0;
+    m->flags = p[1] == '0' ? GP_G0 : 0;
+    p += 2;
+    if (p < end && is_value_char(*p))
+        // Command is G00, G1.5, etc.
+        return 0;
+    for (;;) {
+        while (p < end && is_space(*p))
+            p++;
+        if (p >= end)
+            return 0;
+        char c = *p;
+        if (c == '\n')
+            break;
+        if (c == ';') {
+            // Skip comment
+            while (p < end && *p != '\n')
+                p++;
+            if (p >= end)
+                return 0;
+            break;
+        }
+        int bit;
+        switch (to_upper(c)) {
+        case 'X': bit = 0; break;
+        case 'Y': bit = 1; break;
+        case 'Z': bit = 2; break;
+        case 'E': bit = 3; break;
+        case 'F': bit = 4; break;
+        default: return 0;
+        }
+        if (m->flags & (1 << bit))
+            return 0;
+        const char *vstart = ++p;
+        while (p < end && is_value_char(*p))
+            p++;
+        if (parse_value(vstart, p, &m->params[bit]))
+            return 0;
+        if (bit == 4 && m->params[bit] <= 0.)
+            // Invalid speed - let the g-code parser report the error
+            return 0;
+        m->flags |= 1 << bit;
+    }
+    return p + 1 - start;
+}
+
+// Scan 'data' for consecutive plain G0/G1 commands.  Returns the
+// number of moves stored in 'moves'.
+int __visible
+gcodeparse_moves(const char *data, int len, struct gcode_move *moves, int max)
+{
+    const char *p = data, *end = &data[len];
+    int count = 0;
+    while (count < max && p < end) {
+        struct gcode_move *m = &moves[count];
+        int linelen = parse_move_line(p, end, m);
+        if (!linelen)
+            break;
+        m->length = linelen;
+        p += linelen;
+        count++;
+    }
+    return count;
+}
+
+
+/****************************************************************
+ * Binary move stream
+ ****************************************************************/
+
+// Binary records with an opcode of BG_OP_MOVE or higher are moves.
+// The low bits of the opcode contain the GP_X..GP_G0 flags and each
+// flagged parameter follows as a varint encoding of
+// (zigzag(mantissa) << 3) | decimal_places.
+#define BG_OP_MOVE 0x80
+#define BG_SCALE_BITS 3
+
+static const double pow10_table[1 << BG_SCALE_BITS] = {
+    1., 10., 100., 1000., 10000., 100000., 1000000., 10000000.
+};
+
+// Parse an unsigned little-endian base-128 varint
+static int
+parse_varint(const uint8_t **pp, const uint8_t *end, uint64_t *value)
+{
+    const uint8_t *p = *pp;
+    uint64_t v = 0;
+    int shift = 0;
+    for (;;) {
+        if (p >= end || shift > 63)
+            return -1;
+        uint8_t c = *p++;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            break;
+        shift += 7;
+    }
+    *pp = p;
+    *value = v;
+    return 0;
+}
+
+// Parse a single binary move record - returns the record length on
+// success, or 0 if the data is not a (complete) move record.
+static int
+parse_move_record(const uint8_t *p, const uint8_t *end, struct gcode_move *m)
+{
+    const uint8_t *start = p;
+    if (p >= end || *p < BG_OP_MOVE)
+        return 0;
+    uint32_t flags = *p++ & ~BG_OP_MOVE;
+    if (flags & ~(GP_X | GP_Y | GP_Z | GP_E | GP_F | GP_G0))
+        return 0;
+    m->flags = flags;
+    int i;
+    for (i = 0; i < ARRAY_SIZE(m->params); i++) {
+        if (!(flags & (1 << i)))
+            continue;
+        uint64_t v;
+        if (parse_varint(&p, end, &v))
+            return 0;
+        double scale = pow10_table[v & ((1 << BG_SCALE_BITS) - 1)];
+        v >>= BG_SCALE_BITS;
+        // Both the mantissa and scale are exact, so the division is
+        // correctly rounded and matches strtod() of the decimal text
+        int64_t mantissa = (v >> 1) ^ -(int64_t)(v & 1);
+        m->params[i] = (double)mantissa / scale;
+    }
+    if (flags & GP_F && m->params[4] <= 0.)
+        return 0;
+    return p - start;
+}
+
+// Decode consecutive move records from a binary stream.  Returns the
+// number of moves stored in 'moves'.
+int __visible
+gcodeparse_binary_moves(const char *data, int len
+                        , struct gcode_move *moves, int max)
+{
+    const uint8_t *p = (void*)data, *end = (void*)&data[len];
+    int count = 0;
+    while (count < max && p < end) {
+        struct gcode_move *m = &moves[count];
+        int reclen = parse_move_record(p, end, m);
+        if (!reclen)
+            break;
+        m->length = reclen;
+        p += reclen;
+        count++;
+    }
+    return count;
+}
+
+
+/****************************************************************
+ * Line index
+ ****************************************************************/
+
+// The index stores the file offset of every INDEX_STRIDE'th line
+#define INDEX_STRIDE 256
+#define INDEX_CHUNK (1024*1024)
+
+struct gcode_index {
+    int64_t *offsets;
+    int64_t offsets_count, offsets_alloc;
+    int64_t line_count, data_len;
+    volatile int abort;
+};
+
+// Allocate a new 'gcode_index' object
+struct gcode_index * __visible
+gcodeindex_alloc(void)
+{
+    struct gcode_index *gi = malloc(sizeof(*gi));
+    memset(gi, 0, sizeof(*gi));
+    return gi;
+}
+
+// Free memory associated with a 'gcode_index' object
+void __visible
+gcodeindex_free(struct gcode_index *gi)
+{
+    if (!gi)
+        return;
+    free(gi->offsets);
+    free(gi);
+}
+
+// Request that an in-progress gcodeindex_build() exit early
+void __visible
+gcodeindex_abort(struct gcode_index *gi)
+{
+    gi->abort = 1;
+}
+
+// Store the start offset of the next indexed line
+static int
+add_offset(struct gcode_index *gi, int64_t offset)
+{
+    if (gi->offsets_count >= gi->offsets_alloc) {
+        int64_t new_alloc = gi->offsets_alloc ? gi->offsets_alloc * 2 : 1024;
+        int64_t *new_offsets = realloc(gi->offsets
+                                       , new_alloc * sizeof(*new_offsets));
+        if (!new_offsets) {
+            errorf("gcodeindex: out of memory");
+            return -1;
+        }
+        gi->offsets = new_offsets;
+        gi->offsets_alloc = new_alloc;
+    }
+    gi->offsets[gi->offsets_count++] = offset;
+    return 0;
+}
+
+// Scan the first 'len' bytes of a file and record line offsets.  The
+// file is read with pread() (instead of through a memory mapping) so
+// that a file truncated while indexing results in an error instead of
+// a SIGBUS.  This may take some time on large files; it is intended to
+// be called from a background thread.
+int __visible
+gcodeindex_build(struct gcode_index *gi, int fd, int64_t len)
+{
+    gi->offsets_count = gi->line_count = 0;
+    if (add_offset(gi, 0))
+        return -1;
+    char *buf = malloc(INDEX_CHUNK);
+    if (!buf) {
+        errorf("gcodeindex: out of memory");
+        return -1;
+    }
+    int64_t pos = 0, line_count = 0;
+    int ret = 0;
+    while (pos < len) {
+        if (gi->abort) {
+            ret = -1;
+            break;
+        }
+        int64_t want = len - pos > INDEX_CHUNK ? INDEX_CHUNK : len - pos;
+        ssize_t got = pread(fd, buf, want, pos);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0) {
+            // File was truncated (or read error)
+            ret = -1;
+            break;
+        }
+        const char *p = buf, *end = &buf[got];
+        for (;;) {
+            const char *nl = memchr(p, '\n', end - p);
+            if (!nl)
+                break;
+            p = nl + 1;
+            line_count++;
+            if (!(line_count % INDEX_STRIDE)
+                && add_offset(gi, pos + (p - buf))) {
+                ret = -1;
+                break;
+            }
+        }
+        if (ret)
+            break;
+        pos += got;
+    }
+    free(buf);
+    if (ret)
+        return ret;
+    gi->line_count = line_count;
+    gi->data_len = len;
+    return 0;
+}
+
+// Return the number of newline terminated lines in the file
+int64_t __visible
+gcodeindex_get_line_count(struct gcode_index *gi)
+{
+    return gi->line_count;
+}
+
+// Return the file offset of the start of the given (zero based) line
+int64_t __visible
+gcodeindex_line_to_offset(struct gcode_index *gi, const char *data
+                          , int64_t line)
+{
+    if (line < 0 || line > gi->line_count)
+        return -1;
+    int64_t offset = gi->offsets[line / INDEX_STRIDE];
+    int skip = line % INDEX_STRIDE;
+    while (skip--) {
+        const char *nl = memchr(&data[offset], '\n', gi->data_len - offset);
+        offset = nl + 1 - data;
+    }
+    return offset;
+}
+
+// Return the (zero based) line containing the given file offset
+int64_t __visible
+gcodeindex_offset_to_line(struct gcode_index *gi, const char *data
+                          , int64_t offset)
+{
+    if (offset < 0 || !gi->offsets_count)
+        return -1;
+    // Binary search for the last indexed line at or before offset
+    int64_t lo = 0, hi = gi->offsets_count - 1;
+    while (lo < hi) {
+        int64_t mid = (lo + hi + 1) / 2;
+        if (gi->offsets[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    int64_t line = lo * INDEX_STRIDE, pos = gi->offsets[lo];
+    while (pos < offset) {
+        const char *nl = memchr(&data[pos], '\n', offset - pos);
+        if (!nl)
+            break;
+        pos = nl + 1 - data;
+        line++;
+    }
+    return line;
+}
@@ -7,6 +7,7 @@
 #include <stddef.h> // offsetof
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include "compiler.h" // __visible
 #include "msgblock.h" // message_alloc
 #include "pyhelper.h" // errorf
 
@@ -43,6 +44,8 @@ msgblock_check(uint8_t *need_sync, uint8_t *buf, int buf_len)
     if (msglen < MESSAGE_MIN || msglen > MESSAGE_MAX)
         goto error;
     uint8_t msgseq = buf[MESSAGE_POS_SEQ];
+    if (msgseq & MESSAGE_SEQ_EXT)
+        msgseq &= ~(MESSAGE_SEQ_EXT | MESSAGE_SEQ_EXT_MASK);
     if ((msgseq & ~MESSAGE_SEQ_MASK) != MESSAGE_DEST)
         goto error;
     if (buf_len < msglen)
@@ -119,6 +122,114 @@ msgblock_decode(uint32_t *data, int data_len, uint8_t *msg, int msg_len)
 }
 
 
+/****************************************************************
+ * Response parsing
+ ****************************************************************/
+
+// Each response message id has a list of parameter types
+struct msgparser_format {
+    int param_count;
+    uint8_t param_types[MESSAGE_PAYLOAD_MAX];
+};
+
+struct msgparser {
+    struct msgparser_format *formats[MESSAGE_ID_COUNT];
+};
+
+// Allocate a 'struct msgparser' object
+struct msgparser * __visible
+msgparser_alloc(void)
+{
+    struct msgparser *mp = malloc(sizeof(*mp));
+    memset(mp, 0, sizeof(*mp));
+    return mp;
+}
+
+// Free memory associated with a 'struct msgparser' object
+void __visible
+msgparser_free(struct msgparser *mp)
+{
+    if (!mp)
+        return;
+    int i;
+    for (i=0; i<MESSAGE_ID_COUNT; i++)
+        free(mp->formats[i]);
+    free(mp);
+}
+
+// Register the parameter types of a response message.  Each character
+// of 'param_types' is one of MP_UINT, MP_INT, or MP_BUFFER.
+int __visible
+msgparser_add_format(struct msgparser *mp, int msgid, char *param_types)
+{
+    int count = strlen(param_types);
+    if (msgid < 0 || msgid >= MESSAGE_ID_COUNT
+        || count > MESSAGE_PAYLOAD_MAX) {
+        errorf("msgparser: invalid format for msgid %d", msgid);
+        return -1;
+    }
+    struct msgparser_format *mf = mp->formats[msgid];
+    if (!mf) {
+        mf = mp->formats[msgid] = malloc(sizeof(*mf));
+        if (!mf) {
+            errorf("msgparser: out of memory");
+            return -1;
+        }
+    }
+    mf->param_count = count;
+    memcpy(mf->param_types, param_types, count);
+    return 0;
+}
+
+// Decode the parameters of a received message.  Integers are stored
+// in 'params' (sign extended as needed) and buffers are stored as
+// (length << 16) | offset.  Returns the message id, or -1 if the
+// message is not a known response (or is malformed).
+int __visible
+msgparser_parse(struct msgparser *mp, uint8_t *msg, int msg_len
+                , int64_t *params)
+{
+    if (msg_len < MESSAGE_MIN || msg_len > MESSAGE_MAX)
+        return -1;
+    uint8_t *p = &msg[MESSAGE_HEADER_SIZE];
+    uint8_t *end = &msg[msg_len - MESSAGE_TRAILER_SIZE];
+    if (p >= end)
+        return -1;
+    int msgid = *p++;
+    if (msgid >= MESSAGE_ID_COUNT)
+        return -1;
+    struct msgparser_format *mf = mp->formats[msgid];
+    if (!mf)
+        return -1;
+    int i;
+    for (i=0; i<mf->param_count; i++) {
+        if (p >= end)
+            return -1;
+        switch (mf->param_types[i]) {
+        case MP_UINT:
+            params[i] = parse_int(&p);
+            break;
+        case MP_INT:
+            params[i] = (int32_t)parse_int(&p);
+            break;
+        case MP_BUFFER: {
+            int len = *p++;
+            params[i] = ((int64_t)len << 16) | (p - msg);
+            p += len;
+            break;
+        }
+        default:
+            return -1;
+        }
+        if (p > end)
+            return -1;
+    }
+    if (p != end)
+        return -1;
+    return msgid;
+}
+
+
 /****************************************************************
  * Command queues
  ****************************************************************/
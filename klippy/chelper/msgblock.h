@@ -6,6 +6,7 @@
 
 #define MESSAGE_MIN 5
 #define MESSAGE_MAX 64
+#define MESSAGE_BLOCK_MAX 255
 #define MESSAGE_HEADER_SIZE  2
 #define MESSAGE_TRAILER_SIZE 3
 #define MESSAGE_POS_LEN 0
@@ -15,7 +16,16 @@
 #define MESSAGE_PAYLOAD_MAX (MESSAGE_MAX - MESSAGE_MIN)
 #define MESSAGE_SEQ_MASK 0x0f
 #define MESSAGE_DEST 0x10
+#define MESSAGE_SEQ_EXT 0x80
+#define MESSAGE_SEQ_EXT_MASK 0x60
+#define MESSAGE_SEQ_EXT_COUNT 64
 #define MESSAGE_SYNC 0x7E
+#define MESSAGE_ID_COUNT 128
+
+// Parameter types for msgparser_add_format()
+#define MP_UINT 'u'
+#define MP_INT 'i'
+#define MP_BUFFER 's'
 
 struct queue_message {
     int len;
@@ -42,6 +52,11 @@ struct clock_estimate {
 uint16_t msgblock_crc16_ccitt(uint8_t *buf, uint8_t len);
 int msgblock_check(uint8_t *need_sync, uint8_t *buf, int buf_len);
 int msgblock_decode(uint32_t *data, int data_len, uint8_t *msg, int msg_len);
+struct msgparser *msgparser_alloc(void);
+void msgparser_free(struct msgparser *mp);
+int msgparser_add_format(struct msgparser *mp, int msgid, char *param_types);
+int msgparser_parse(struct msgparser *mp, uint8_t *msg, int msg_len
+                    , int64_t *params);
 struct queue_message *message_alloc(void);
 struct queue_message *message_fill(uint8_t *data, int len);
 struct queue_message *message_alloc_and_encode(uint32_t *data, int len);
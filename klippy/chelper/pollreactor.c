@@ -4,48 +4,160 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <errno.h> // errno
 #include <fcntl.h> // fcntl
-#include <math.h> // ceil
-#include <poll.h> // poll
+#include <stdint.h> // uint64_t
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include <sys/epoll.h> // epoll_wait
+#include <sys/timerfd.h> // timerfd_settime
+#include <unistd.h> // read
 #include "pollreactor.h" // pollreactor_alloc
 #include "pyhelper.h" // report_errno
 
+struct pollreactor_fd {
+    int fd;
+    void (*callback)(void *data, double eventtime);
+    void *data;
+};
+
 struct pollreactor_timer {
     double waketime;
     double (*callback)(void *data, double eventtime);
+    void *data;
+    int heap_pos;
 };
 
 struct pollreactor {
     int num_fds, num_timers, must_exit;
-    void *callback_data;
-    double next_timer;
-    struct pollfd *fds;
-    void (**fd_callbacks)(void *data, double eventtime);
+    int epoll_fd, timer_fd;
+    double armed_waketime;
+    struct pollreactor_fd *fds;
     struct pollreactor_timer *timers;
+    // Timers (by index) in a binary min-heap ordered by waketime
+    int *timer_heap, heap_count;
+    int *run_list;
 };
 
+// epoll event data value used for the internal timerfd
+#define PR_TIMER_FD_POS -1
+
+
+/****************************************************************
+ * Timer heap
+ ****************************************************************/
+
+static inline double
+heap_waketime(struct pollreactor *pr, int pos)
+{
+    return pr->timers[pr->timer_heap[pos]].waketime;
+}
+
+static void
+heap_set(struct pollreactor *pr, int pos, int timer_idx)
+{
+    pr->timer_heap[pos] = timer_idx;
+    pr->timers[timer_idx].heap_pos = pos;
+}
+
+// Move a heap entry towards the root until the heap is ordered
+static void
+heap_sift_up(struct pollreactor *pr, int pos)
+{
+    int timer_idx = pr->timer_heap[pos];
+    double waketime = pr->timers[timer_idx].waketime;
+    while (pos) {
+        int parent = (pos - 1) / 2;
+        if (heap_waketime(pr, parent) <= waketime)
+            break;
+        heap_set(pr, pos, pr->timer_heap[parent]);
+        pos = parent;
+    }
+    heap_set(pr, pos, timer_idx);
+}
+
+// Move a heap entry away from the root until the heap is ordered
+static void
+heap_sift_down(struct pollreactor *pr, int pos)
+{
+    int timer_idx = pr->timer_heap[pos];
+    double waketime = pr->timers[timer_idx].waketime;
+    for (;;) {
+        int child = pos * 2 + 1;
+        if (child >= pr->heap_count)
+            break;
+        if (child + 1 < pr->heap_count
+            && heap_waketime(pr, child + 1) < heap_waketime(pr, child))
+            child++;
+        if (waketime <= heap_waketime(pr, child))
+            break;
+        heap_set(pr, pos, pr->timer_heap[child]);
+        pos = child;
+    }
+    heap_set(pr, pos, timer_idx);
+}
+
+static void
+heap_insert(struct pollreactor *pr, int timer_idx)
+{
+    int pos = pr->heap_count++;
+    heap_set(pr, pos, timer_idx);
+    heap_sift_up(pr, pos);
+}
+
+// Remove and return the timer with the earliest waketime
+static int
+heap_pop(struct pollreactor *pr)
+{
+    int timer_idx = pr->timer_heap[0];
+    pr->timers[timer_idx].heap_pos = -1;
+    if (--pr->heap_count) {
+        heap_set(pr, 0, pr->timer_heap[pr->heap_count]);
+        heap_sift_down(pr, 0);
+    }
+    return timer_idx;
+}
+
+
+/****************************************************************
+ * Reactor interface
+ ****************************************************************/
+
 // Allocate a new 'struct pollreactor' object
 struct pollreactor *
-pollreactor_alloc(int num_fds, int num_timers, void *callback_data)
+pollreactor_alloc(int num_fds, int num_timers)
 {
     struct pollreactor *pr = malloc(sizeof(*pr));
     memset(pr, 0, sizeof(*pr));
     pr->num_fds = num_fds;
     pr->num_timers = num_timers;
     pr->must_exit = 0;
-    pr->callback_data = callback_data;
-    pr->next_timer = PR_NEVER;
+    pr->armed_waketime = PR_NEVER;
     pr->fds = malloc(num_fds * sizeof(*pr->fds));
     memset(pr->fds, 0, num_fds * sizeof(*pr->fds));
-    pr->fd_callbacks = malloc(num_fds * sizeof(*pr->fd_callbacks));
-    memset(pr->fd_callbacks, 0, num_fds * sizeof(*pr->fd_callbacks));
     pr->timers = malloc(num_timers * sizeof(*pr->timers));
     memset(pr->timers, 0, num_timers * sizeof(*pr->timers));
+    pr->timer_heap = malloc(num_timers * sizeof(*pr->timer_heap));
+    pr->run_list = malloc(num_timers * sizeof(*pr->run_list));
     int i;
-    for (i=0; i<num_timers; i++)
+    for (i=0; i<num_fds; i++)
+        pr->fds[i].fd = -1;
+    for (i=0; i<num_timers; i++) {
         pr->timers[i].waketime = PR_NEVER;
+        heap_insert(pr, i);
+    }
+
+    // Setup epoll and a timerfd for timer wakeups
+    pr->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (pr->epoll_fd < 0)
+        report_errno("epoll_create1", pr->epoll_fd);
+    pr->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (pr->timer_fd < 0)
+        report_errno("timerfd_create", pr->timer_fd);
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = PR_TIMER_FD_POS };
+    int ret = epoll_ctl(pr->epoll_fd, EPOLL_CTL_ADD, pr->timer_fd, &ev);
+    if (ret < 0)
+        report_errno("epoll_ctl timerfd", ret);
     return pr;
 }
 
@@ -53,32 +165,70 @@ pollreactor_alloc(int num_fds, int num_timers, void *callback_data)
 void
 pollreactor_free(struct pollreactor *pr)
 {
+    close(pr->timer_fd);
+    close(pr->epoll_fd);
     free(pr->fds);
     pr->fds = NULL;
-    free(pr->fd_callbacks);
-    pr->fd_callbacks = NULL;
     free(pr->timers);
     pr->timers = NULL;
+    free(pr->timer_heap);
+    free(pr->run_list);
     free(pr);
 }
 
 // Add a callback for when a file descriptor (fd) becomes readable
 void
 pollreactor_add_fd(struct pollreactor *pr, int pos, int fd, void *callback
-                   , int write_only)
+                   , void *data, int write_only)
 {
-    pr->fds[pos].fd = fd;
-    pr->fds[pos].events = POLLHUP | (write_only ? 0 : POLLIN);
-    pr->fds[pos].revents = 0;
-    pr->fd_callbacks[pos] = callback;
+    struct pollreactor_fd *pfd = &pr->fds[pos];
+    pfd->callback = callback;
+    pfd->data = data;
+    struct epoll_event ev = {
+        .events = EPOLLHUP | (write_only ? 0 : EPOLLIN), .data.u32 = pos
+    };
+    int ret = epoll_ctl(pr->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    if (ret < 0) {
+        if (!(errno == EPERM && write_only))
+            // Regular (output only) files can't be polled - ignore them
+            report_errno("epoll_ctl", ret);
+        return;
+    }
+    pfd->fd = fd;
+}
+
+// Stop monitoring a file descriptor added with pollreactor_add_fd()
+void
+pollreactor_rm_fd(struct pollreactor *pr, int pos)
+{
+    struct pollreactor_fd *pfd = &pr->fds[pos];
+    if (pfd->fd >= 0) {
+        int ret = epoll_ctl(pr->epoll_fd, EPOLL_CTL_DEL, pfd->fd, NULL);
+        if (ret < 0)
+            report_errno("epoll_ctl del", ret);
+    }
+    pfd->fd = -1;
+    pfd->callback = NULL;
+    pfd->data = NULL;
 }
 
 // Add a timer callback
 void
-pollreactor_add_timer(struct pollreactor *pr, int pos, void *callback)
+pollreactor_add_timer(struct pollreactor *pr, int pos, void *callback
+                      , void *data)
 {
     pr->timers[pos].callback = callback;
-    pr->timers[pos].waketime = PR_NEVER;
+    pr->timers[pos].data = data;
+    pollreactor_update_timer(pr, pos, PR_NEVER);
+}
+
+// Disable a timer added with pollreactor_add_timer()
+void
+pollreactor_rm_timer(struct pollreactor *pr, int pos)
+{
+    pollreactor_update_timer(pr, pos, PR_NEVER);
+    pr->timers[pos].callback = NULL;
+    pr->timers[pos].data = NULL;
 }
 
 // Return the last schedule wake-up time for a timer
@@ -92,58 +242,103 @@ pollreactor_get_timer(struct pollreactor *pr, int pos)
 void
 pollreactor_update_timer(struct pollreactor *pr, int pos, double waketime)
 {
-    pr->timers[pos].waketime = waketime;
-    if (waketime < pr->next_timer)
-        pr->next_timer = waketime;
+    struct pollreactor_timer *timer = &pr->timers[pos];
+    double old_waketime = timer->waketime;
+    timer->waketime = waketime;
+    if (timer->heap_pos < 0)
+        // Timer is running - it is added back to the heap afterwards
+        return;
+    if (waketime < old_waketime)
+        heap_sift_up(pr, timer->heap_pos);
+    else
+        heap_sift_down(pr, timer->heap_pos);
+}
+
+// Arm the timerfd so that epoll_wait() returns at the given time
+static void
+pollreactor_arm_timer(struct pollreactor *pr, double waketime
+                      , double eventtime)
+{
+    if (waketime == pr->armed_waketime)
+        return;
+    pr->armed_waketime = waketime;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (waketime < PR_NEVER) {
+        its.it_value = fill_time(waketime - eventtime);
+        if (!its.it_value.tv_sec && its.it_value.tv_nsec <= 0)
+            its.it_value.tv_nsec = 1;
+    }
+    int ret = timerfd_settime(pr->timer_fd, 0, &its, NULL);
+    if (ret < 0)
+        report_errno("timerfd_settime", ret);
 }
 
 // Internal code to invoke timer callbacks
 static int
 pollreactor_check_timers(struct pollreactor *pr, double eventtime, int busy)
 {
-    if (eventtime >= pr->next_timer) {
-        // Find and run pending timers
-        pr->next_timer = PR_NEVER;
-        int i;
-        for (i=0; i<pr->num_timers; i++) {
-            struct pollreactor_timer *timer = &pr->timers[i];
-            double t = timer->waketime;
-            if (eventtime >= t) {
+    if (pr->heap_count && eventtime >= heap_waketime(pr, 0)) {
+        // Remove pending timers from the heap (so that each timer is
+        // invoked at most once per pass) and then run them
+        int run_count = 0, i;
+        while (pr->heap_count && eventtime >= heap_waketime(pr, 0))
+            pr->run_list[run_count++] = heap_pop(pr);
+        for (i=0; i<run_count; i++) {
+            struct pollreactor_timer *timer = &pr->timers[pr->run_list[i]];
+            if (eventtime >= timer->waketime && timer->callback) {
                 busy = 1;
-                t = timer->callback(pr->callback_data, eventtime);
-                timer->waketime = t;
+                timer->waketime = timer->callback(timer->data, eventtime);
             }
-            if (t < pr->next_timer)
-                pr->next_timer = t;
         }
+        for (i=0; i<run_count; i++)
+            heap_insert(pr, pr->run_list[i]);
     }
     if (busy)
         return 0;
-    // Calculate sleep duration
-    double timeout = ceil((pr->next_timer - eventtime) * 1000.);
-    return timeout < 1. ? 1 : (timeout > 1000. ? 1000 : (int)timeout);
+    // Arm timerfd for the next timer and sleep until an event
+    double next_timer = pr->heap_count ? heap_waketime(pr, 0) : PR_NEVER;
+    pollreactor_arm_timer(pr, next_timer, eventtime);
+    return -1;
 }
 
 // Repeatedly check for timer and fd events and invoke their callbacks
 void
 pollreactor_run(struct pollreactor *pr)
 {
+    struct epoll_event events[pr->num_fds + 1];
     double eventtime = get_monotonic();
     int busy = 1;
     while (! pr->must_exit) {
         int timeout = pollreactor_check_timers(pr, eventtime, busy);
         busy = 0;
-        int ret = poll(pr->fds, pr->num_fds, timeout);
+        int ret = epoll_wait(pr->epoll_fd, events, pr->num_fds + 1, timeout);
         eventtime = get_monotonic();
-        if (ret > 0) {
-            busy = 1;
-            int i;
-            for (i=0; i<pr->num_fds; i++)
-                if (pr->fds[i].revents)
-                    pr->fd_callbacks[i](pr->callback_data, eventtime);
-        } else if (ret < 0) {
-            report_errno("poll", ret);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            report_errno("epoll_wait", ret);
             pr->must_exit = 1;
+            break;
+        }
+        int i;
+        for (i=0; i<ret; i++) {
+            int pos = events[i].data.u32;
+            if (pos == PR_TIMER_FD_POS) {
+                // Timer expired - clear the timerfd
+                uint64_t expirations;
+                int r = read(pr->timer_fd, &expirations, sizeof(expirations));
+                if (r < 0 && errno != EAGAIN)
+                    report_errno("timerfd read", r);
+                pr->armed_waketime = PR_NEVER;
+                continue;
+            }
+            // Callbacks may remove fds - skip events for removed fds
+            struct pollreactor_fd *pfd = &pr->fds[pos];
+            if (!pfd->callback)
+                continue;
+            busy = 1;
+            pfd->callback(pfd->data, eventtime);
         }
     }
 }
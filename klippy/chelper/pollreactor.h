@@ -4,12 +4,14 @@
 #define PR_NOW   0.
 #define PR_NEVER 9999999999999999.
 
-struct pollreactor *pollreactor_alloc(int num_fds, int num_timers
-                                      , void *callback_data);
+struct pollreactor *pollreactor_alloc(int num_fds, int num_timers);
 void pollreactor_free(struct pollreactor *pr);
 void pollreactor_add_fd(struct pollreactor *pr, int pos, int fd, void *callback
-                        , int write_only);
-void pollreactor_add_timer(struct pollreactor *pr, int pos, void *callback);
+                        , void *data, int write_only);
+void pollreactor_rm_fd(struct pollreactor *pr, int pos);
+void pollreactor_add_timer(struct pollreactor *pr, int pos, void *callback
+                           , void *data);
+void pollreactor_rm_timer(struct pollreactor *pr, int pos);
 double pollreactor_get_timer(struct pollreactor *pr, int pos);
 void pollreactor_update_timer(struct pollreactor *pr, int pos, double waketime);
 void pollreactor_run(struct pollreactor *pr);
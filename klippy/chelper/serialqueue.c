@@ -12,15 +12,20 @@
 // clock times, prioritizes commands, and handles retransmissions.  A
 // background thread is launched to do this work and minimize latency.
 
+#define _GNU_SOURCE
+#include <errno.h> // errno
 #include <linux/can.h> // // struct can_frame
 #include <math.h> // fabs
 #include <pthread.h> // pthread_mutex_lock
+#include <sched.h> // sched_param
 #include <stddef.h> // offsetof
 #include <stdint.h> // uint64_t
 #include <stdio.h> // snprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include <sys/syscall.h> // SYS_gettid
 #include <termios.h> // tcflush
+#include <time.h> // clock_gettime
 #include <unistd.h> // pipe
 #include "compiler.h" // __visible
 #include "list.h" // list_add_tail
@@ -36,25 +41,29 @@ struct command_queue {
 
 struct serialqueue {
     // Input reading
-    struct pollreactor *pr;
+    struct serialthread *st;
+    int st_slot, st_request;
+    struct list_node st_node;
     int serial_fd, serial_fd_type, client_id;
     int pipe_fds[2];
     uint8_t input_buf[4096];
     uint8_t need_sync;
     int input_pos;
     // Threading
-    pthread_t tid;
     pthread_mutex_t lock; // protects variables below
     pthread_cond_t cond;
-    int receive_waiting;
+    int receive_waiting, is_exit;
     // Baud / clock tracking
-    int receive_window;
+    int receive_window, block_max;
     double bittime_adjust, idle_time;
     struct clock_estimate ce;
     double last_receive_sent_time;
     // Retransmit support
     uint64_t send_seq, receive_seq;
     uint64_t ignore_nak_seq, last_ack_seq, retransmit_seq, rtt_sample_seq;
+    uint64_t ext_seq_start;
+    int selective, retransmit_selective;
+    double selective_nak_time;
     struct list_head sent_queue;
     double srtt, rttvar, rto;
     // Pending transmission message queues
@@ -88,6 +97,7 @@ struct serialqueue {
 #define MIN_RTO 0.025
 #define MAX_RTO 5.000
 #define MAX_PENDING_BLOCKS 12
+#define MAX_PENDING_BLOCKS_EXT (MESSAGE_SEQ_EXT_COUNT / 2)
 #define MIN_REQTIME_DELTA 0.250
 #define MIN_BACKGROUND_DELTA 0.005
 #define IDLE_QUERY_TIME 1.0
@@ -95,6 +105,36 @@ struct serialqueue {
 #define DEBUG_QUEUE_SENT 100
 #define DEBUG_QUEUE_RECEIVE 100
 
+// A message block sent to the mcu (which may be larger than the
+// MESSAGE_MAX sized queue_message used for individual commands)
+struct sent_block {
+    int len;
+    uint8_t msg[MESSAGE_BLOCK_MAX];
+    double sent_time, receive_time;
+    struct list_node node;
+};
+
+// Allocate a sent_block
+static struct sent_block *
+sent_block_alloc(void)
+{
+    struct sent_block *sb = malloc(sizeof(*sb));
+    memset(sb, 0, sizeof(*sb));
+    return sb;
+}
+
+// Free all the sent_blocks on a list
+static void
+sent_block_queue_free(struct list_head *root)
+{
+    while (!list_empty(root)) {
+        struct sent_block *sb = list_first_entry(
+            root, struct sent_block, node);
+        list_del(&sb->node);
+        free(sb);
+    }
+}
+
 // Create a series of empty messages and add them to a list
 static void
 debug_queue_alloc(struct list_head *root, int count)
@@ -117,6 +157,27 @@ debug_queue_add(struct list_head *root, struct queue_message *qm)
     message_free(old);
 }
 
+// Create a series of empty sent blocks and add them to a list
+static void
+debug_sent_alloc(struct list_head *root, int count)
+{
+    int i;
+    for (i=0; i<count; i++) {
+        struct sent_block *sb = sent_block_alloc();
+        list_add_head(&sb->node, root);
+    }
+}
+
+// Move a sent block to the sent debug queue and free the oldest entry
+static void
+debug_sent_add(struct list_head *root, struct sent_block *sb)
+{
+    list_add_tail(&sb->node, root);
+    struct sent_block *old = list_first_entry(root, struct sent_block, node);
+    list_del(&old->node);
+    free(old);
+}
+
 // Wake up the receiver thread if it is waiting
 static void
 check_wake_receive(struct serialqueue *sq)
@@ -136,6 +197,72 @@ kick_bg_thread(struct serialqueue *sq)
         report_errno("pipe write", ret);
 }
 
+// A background thread services one or more serialqueues from a single
+// pollreactor.  Each serialqueue is assigned a "slot" in the reactor
+// containing SQPF_NUM file descriptors and SQPT_NUM timers.  By
+// default each serialqueue has its own thread, but serialqueues may
+// also share a single thread (to reduce thread count and context
+// switches on hosts with many micro-controllers).
+
+struct serialthread {
+    struct pollreactor *pr;
+    pthread_t tid;
+    int pipe_fds[2];
+    int max_queues, user_count;
+    struct serialqueue **queues;
+    pthread_mutex_t lock; // protects variables below
+    pthread_cond_t cond;
+    int thread_id, is_exit;
+    struct list_head requests;
+};
+
+#define STF_CONTROL 0
+#define STF_SLOTS   1
+
+enum { STR_ATTACH = 1, STR_DETACH };
+
+#define SHARED_THREAD_MAX_QUEUES 32
+
+static struct serialthread *shared_serialthread;
+static pthread_mutex_t shared_serialthread_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set the wake-up time of a serialqueue timer
+static void
+sq_update_timer(struct serialqueue *sq, int timer, double waketime)
+{
+    pollreactor_update_timer(sq->st->pr, sq->st_slot * SQPT_NUM + timer
+                             , waketime);
+}
+
+// Return the last scheduled wake-up time of a serialqueue timer
+static double
+sq_get_timer(struct serialqueue *sq, int timer)
+{
+    return pollreactor_get_timer(sq->st->pr, sq->st_slot * SQPT_NUM + timer);
+}
+
+// Stop servicing a serialqueue (called from background thread)
+static void
+serialthread_detach_queue(struct serialqueue *sq)
+{
+    struct serialthread *st = sq->st;
+    int slot = sq->st_slot;
+    if (slot < 0)
+        return;
+    int fpos = STF_SLOTS + slot * SQPF_NUM, tpos = slot * SQPT_NUM;
+    pollreactor_rm_fd(st->pr, fpos + SQPF_SERIAL);
+    pollreactor_rm_fd(st->pr, fpos + SQPF_PIPE);
+    pollreactor_rm_timer(st->pr, tpos + SQPT_RETRANSMIT);
+    pollreactor_rm_timer(st->pr, tpos + SQPT_COMMAND);
+    st->queues[slot] = NULL;
+    sq->st_slot = -1;
+
+    pthread_mutex_lock(&sq->lock);
+    sq->is_exit = 1;
+    check_wake_receive(sq);
+    pthread_mutex_unlock(&sq->lock);
+}
+
 // Minimum number of bits in a canbus message
 #define CANBUS_PACKET_BITS ((1 + 11 + 3 + 4) + (16 + 2 + 7 + 3))
 #define CANBUS_IFS_BITS 4
@@ -153,6 +280,13 @@ calculate_bittime(struct serialqueue *sq, uint32_t bytes)
     }
 }
 
+// Check if all unacknowledged blocks use extended sequence numbers
+static int
+is_ext_seq(struct serialqueue *sq)
+{
+    return sq->ext_seq_start && sq->receive_seq >= sq->ext_seq_start;
+}
+
 // Update internal state when the receive sequence increases
 static void
 update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
@@ -160,8 +294,8 @@ update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
     // Remove from sent queue
     uint64_t sent_seq = sq->receive_seq;
     for (;;) {
-        struct queue_message *sent = list_first_entry(
-            &sq->sent_queue, struct queue_message, node);
+        struct sent_block *sent = list_first_entry(
+            &sq->sent_queue, struct sent_block, node);
         if (list_empty(&sq->sent_queue)) {
             // Got an ack for a message not sent; must be connection init
             sq->send_seq = rseq;
@@ -170,7 +304,7 @@ update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
         }
         sq->need_ack_bytes -= sent->len;
         list_del(&sent->node);
-        debug_queue_add(&sq->old_sent, sent);
+        debug_sent_add(&sq->old_sent, sent);
         sent_seq++;
         if (rseq == sent_seq) {
             // Found sent message corresponding with the received sequence
@@ -180,7 +314,7 @@ update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
         }
     }
     sq->receive_seq = rseq;
-    pollreactor_update_timer(sq->pr, SQPT_COMMAND, PR_NOW);
+    sq_update_timer(sq, SQPT_COMMAND, PR_NOW);
 
     // Update retransmit info
     if (sq->rtt_sample_seq && rseq > sq->rtt_sample_seq
@@ -205,12 +339,12 @@ update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
         sq->rtt_sample_seq = 0;
     }
     if (list_empty(&sq->sent_queue)) {
-        pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, PR_NEVER);
+        sq_update_timer(sq, SQPT_RETRANSMIT, PR_NEVER);
     } else {
-        struct queue_message *sent = list_first_entry(
-            &sq->sent_queue, struct queue_message, node);
+        struct sent_block *sent = list_first_entry(
+            &sq->sent_queue, struct sent_block, node);
         double nr = eventtime + sq->rto + calculate_bittime(sq, sent->len);
-        pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, nr);
+        sq_update_timer(sq, SQPT_RETRANSMIT, nr);
     }
 }
 
@@ -221,12 +355,24 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
     pthread_mutex_lock(&sq->lock);
 
     // Calculate receive sequence number
-    uint64_t rseq = ((sq->receive_seq & ~MESSAGE_SEQ_MASK)
-                     | (sq->input_buf[MESSAGE_POS_SEQ] & MESSAGE_SEQ_MASK));
+    uint8_t msgseq = sq->input_buf[MESSAGE_POS_SEQ];
+    uint64_t seq_mask = MESSAGE_SEQ_MASK, seq = msgseq & MESSAGE_SEQ_MASK;
+    int msg_ext = msgseq & MESSAGE_SEQ_EXT;
+    if (msg_ext) {
+        seq_mask = MESSAGE_SEQ_EXT_COUNT - 1;
+        seq |= (msgseq & MESSAGE_SEQ_EXT_MASK) >> 1;
+    }
+    if (msg_ext ? !sq->ext_seq_start : is_ext_seq(sq)) {
+        // Sequence number encoding not valid for this session
+        sq->bytes_invalid += len;
+        pthread_mutex_unlock(&sq->lock);
+        return;
+    }
+    uint64_t rseq = (sq->receive_seq & ~seq_mask) | seq;
     if (rseq != sq->receive_seq) {
         // New sequence number
         if (rseq < sq->receive_seq)
-            rseq += MESSAGE_SEQ_MASK+1;
+            rseq += seq_mask + 1;
         if (rseq > sq->send_seq && sq->receive_seq != 1) {
             // An ack for a message not sent?  Out of order message?
             sq->bytes_invalid += len;
@@ -254,15 +400,37 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
         must_wake = 1;
     }
 
+    // Check fast readers
+    struct fastreader *fr, *found_fr = NULL;
+    list_for_each_entry(fr, &sq->fast_readers, node) {
+        if (len < fr->prefix_len + MESSAGE_MIN
+            || memcmp(&sq->input_buf[MESSAGE_HEADER_SIZE]
+                      , fr->prefix, fr->prefix_len) != 0)
+            continue;
+        found_fr = fr;
+        break;
+    }
+
     // Process message
     if (len == MESSAGE_MIN) {
         // Ack/nak message
-        if (sq->last_ack_seq < rseq)
+        if (sq->last_ack_seq < rseq) {
             sq->last_ack_seq = rseq;
-        else if (rseq > sq->ignore_nak_seq && !list_empty(&sq->sent_queue))
+            if (sq->retransmit_selective && rseq < sq->retransmit_seq)
+                // Partial ack after a selective retransmit - the mcu
+                // is missing another block
+                sq_update_timer(sq, SQPT_RETRANSMIT, PR_NOW);
+        } else if (rseq > sq->ignore_nak_seq && !list_empty(&sq->sent_queue)) {
             // Duplicate Ack is a Nak - do fast retransmit
-            pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, PR_NOW);
-    } else {
+            sq_update_timer(sq, SQPT_RETRANSMIT, PR_NOW);
+        } else if (sq->retransmit_selective && rseq == sq->receive_seq
+                   && eventtime > sq->selective_nak_time
+                   && !list_empty(&sq->sent_queue)) {
+            // Nak for a block sent after a selective retransmit - the
+            // retransmitted block was lost
+            sq_update_timer(sq, SQPT_RETRANSMIT, PR_NOW);
+        }
+    } else if (!found_fr || !found_fr->exclusive) {
         // Data message - add to receive queue
         struct queue_message *qm = message_fill(sq->input_buf, len);
         qm->sent_time = (rseq > sq->retransmit_seq
@@ -273,19 +441,13 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
         must_wake = 1;
     }
 
-    // Check fast readers
-    struct fastreader *fr;
-    list_for_each_entry(fr, &sq->fast_readers, node) {
-        if (len < fr->prefix_len + MESSAGE_MIN
-            || memcmp(&sq->input_buf[MESSAGE_HEADER_SIZE]
-                      , fr->prefix, fr->prefix_len) != 0)
-            continue;
-        // Release main lock and invoke callback
+    if (found_fr) {
+        // Release main lock and invoke fast reader callback
         pthread_mutex_lock(&sq->fast_reader_dispatch_lock);
         if (must_wake)
             check_wake_receive(sq);
         pthread_mutex_unlock(&sq->lock);
-        fr->func(fr, sq->input_buf, len);
+        found_fr->func(found_fr, sq->input_buf, len);
         pthread_mutex_unlock(&sq->fast_reader_dispatch_lock);
         return;
     }
@@ -302,9 +464,11 @@ input_event(struct serialqueue *sq, double eventtime)
     if (sq->serial_fd_type == SQT_CAN) {
         struct can_frame cf;
         int ret = read(sq->serial_fd, &cf, sizeof(cf));
+        if (ret < 0 && errno == EAGAIN)
+            return;
         if (ret <= 0) {
             report_errno("can read", ret);
-            pollreactor_do_exit(sq->pr);
+            serialthread_detach_queue(sq);
             return;
         }
         if (cf.can_id != sq->client_id + 1)
@@ -314,12 +478,14 @@ input_event(struct serialqueue *sq, double eventtime)
     } else {
         int ret = read(sq->serial_fd, &sq->input_buf[sq->input_pos]
                        , sizeof(sq->input_buf) - sq->input_pos);
+        if (ret < 0 && errno == EAGAIN)
+            return;
         if (ret <= 0) {
             if(ret < 0)
                 report_errno("read", ret);
             else
                 errorf("Got EOF when reading from device");
-            pollreactor_do_exit(sq->pr);
+            serialthread_detach_queue(sq);
             return;
         }
         sq->input_pos += ret;
@@ -351,9 +517,9 @@ kick_event(struct serialqueue *sq, double eventtime)
 {
     char dummy[4096];
     int ret = read(sq->pipe_fds[0], dummy, sizeof(dummy));
-    if (ret < 0)
+    if (ret < 0 && errno != EAGAIN)
         report_errno("pipe read", ret);
-    pollreactor_update_timer(sq->pr, SQPT_COMMAND, PR_NOW);
+    sq_update_timer(sq, SQPT_COMMAND, PR_NOW);
 }
 
 // OS write of data to be sent to the mcu
@@ -395,25 +561,32 @@ retransmit_event(struct serialqueue *sq, double eventtime)
 
     pthread_mutex_lock(&sq->lock);
 
-    // Retransmit all pending messages
-    uint8_t buf[MESSAGE_MAX * MAX_PENDING_BLOCKS + 1];
+    // If the mcu stores out of order blocks then only the first
+    // missing block needs to be retransmitted
+    int is_nak = sq_get_timer(sq, SQPT_RETRANSMIT) == PR_NOW;
+    int selective = sq->selective && is_ext_seq(sq);
+
+    // Retransmit pending messages
+    uint8_t buf[MESSAGE_BLOCK_MAX * MAX_PENDING_BLOCKS_EXT + 1];
     int buflen = 0, first_buflen = 0;
     buf[buflen++] = MESSAGE_SYNC;
-    struct queue_message *qm;
-    list_for_each_entry(qm, &sq->sent_queue, node) {
-        memcpy(&buf[buflen], qm->msg, qm->len);
-        buflen += qm->len;
+    struct sent_block *sb;
+    list_for_each_entry(sb, &sq->sent_queue, node) {
+        memcpy(&buf[buflen], sb->msg, sb->len);
+        buflen += sb->len;
         if (!first_buflen)
-            first_buflen = qm->len + 1;
+            first_buflen = sb->len + 1;
+        if (selective)
+            break;
     }
     do_write(sq, buf, buflen);
     sq->bytes_retransmit += buflen;
 
     // Update rto
-    if (pollreactor_get_timer(sq->pr, SQPT_RETRANSMIT) == PR_NOW) {
+    if (is_nak) {
         // Retransmit due to nak
         sq->ignore_nak_seq = sq->receive_seq;
-        if (sq->receive_seq < sq->retransmit_seq)
+        if (!selective && sq->receive_seq < sq->retransmit_seq)
             // Second nak for this retransmit - don't allow third
             sq->ignore_nak_seq = sq->retransmit_seq;
     } else {
@@ -421,8 +594,16 @@ retransmit_event(struct serialqueue *sq, double eventtime)
         sq->rto *= 2.0;
         if (sq->rto > MAX_RTO)
             sq->rto = MAX_RTO;
-        sq->ignore_nak_seq = sq->send_seq;
+        sq->ignore_nak_seq = selective ? sq->receive_seq : sq->send_seq;
+    }
+    if (selective) {
+        // Naks arriving after the retransmitted block should have been
+        // received indicate that it was lost again
+        double rtt = sq->srtt ? sq->srtt + 4.0 * sq->rttvar : sq->rto;
+        sq->selective_nak_time = (eventtime + rtt
+                                  + calculate_bittime(sq, first_buflen));
     }
+    sq->retransmit_selective = selective;
     sq->retransmit_seq = sq->send_seq;
     sq->rtt_sample_seq = 0;
     sq->idle_time = eventtime + calculate_bittime(sq, buflen);
@@ -455,7 +636,7 @@ build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
             }
         }
         // Append message to outgoing command
-        if (len + qm->len > MESSAGE_MAX - MESSAGE_TRAILER_SIZE)
+        if (len + qm->len > sq->block_max - MESSAGE_TRAILER_SIZE)
             break;
         list_del(&qm->node);
         if (list_empty(&cq->ready_queue) && list_empty(&cq->upcoming_queue))
@@ -476,6 +657,9 @@ build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
     len += MESSAGE_TRAILER_SIZE;
     buf[MESSAGE_POS_LEN] = len;
     buf[MESSAGE_POS_SEQ] = MESSAGE_DEST | (sq->send_seq & MESSAGE_SEQ_MASK);
+    if (sq->ext_seq_start && sq->send_seq >= sq->ext_seq_start)
+        buf[MESSAGE_POS_SEQ] |= (MESSAGE_SEQ_EXT
+                                 | ((sq->send_seq<<1) & MESSAGE_SEQ_EXT_MASK));
     uint16_t crc = msgblock_crc16_ccitt(buf, len - MESSAGE_TRAILER_SIZE);
     buf[len - MESSAGE_TRAILER_CRC] = crc >> 8;
     buf[len - MESSAGE_TRAILER_CRC+1] = crc & 0xff;
@@ -484,13 +668,13 @@ build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
     // Store message block
     double idletime = eventtime > sq->idle_time ? eventtime : sq->idle_time;
     idletime += calculate_bittime(sq, pending + len);
-    struct queue_message *out = message_alloc();
+    struct sent_block *out = sent_block_alloc();
     memcpy(out->msg, buf, len);
     out->len = len;
     out->sent_time = eventtime;
     out->receive_time = idletime;
     if (list_empty(&sq->sent_queue))
-        pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, idletime + sq->rto);
+        sq_update_timer(sq, SQPT_RETRANSMIT, idletime + sq->rto);
     if (!sq->rtt_sample_seq)
         sq->rtt_sample_seq = sq->send_seq;
     sq->send_seq++;
@@ -503,12 +687,14 @@ build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
 static double
 check_send_command(struct serialqueue *sq, int pending, double eventtime)
 {
-    if (sq->send_seq - sq->receive_seq >= MAX_PENDING_BLOCKS
+    int max_pending = is_ext_seq(sq) ? MAX_PENDING_BLOCKS_EXT
+                                     : MAX_PENDING_BLOCKS;
+    if (sq->send_seq - sq->receive_seq >= max_pending
         && sq->receive_seq != (uint64_t)-1)
         // Need an ack before more messages can be sent
         return PR_NEVER;
     if (sq->send_seq > sq->receive_seq && sq->receive_window) {
-        int need_ack_bytes = sq->need_ack_bytes + MESSAGE_MAX;
+        int need_ack_bytes = sq->need_ack_bytes + sq->block_max;
         if (sq->last_ack_seq < sq->receive_seq)
             need_ack_bytes += sq->last_ack_bytes;
         if (need_ack_bytes > sq->receive_window)
@@ -552,7 +738,7 @@ check_send_command(struct serialqueue *sq, int pending, double eventtime)
     }
 
     // Check for messages to send
-    if (sq->ready_bytes >= MESSAGE_PAYLOAD_MAX)
+    if (sq->ready_bytes >= sq->block_max - MESSAGE_MIN)
         return PR_NOW;
     if (! sq->ce.est_freq) {
         if (sq->ready_bytes)
@@ -575,12 +761,12 @@ static double
 command_event(struct serialqueue *sq, double eventtime)
 {
     pthread_mutex_lock(&sq->lock);
-    uint8_t buf[MESSAGE_MAX * MAX_PENDING_BLOCKS];
+    uint8_t buf[MESSAGE_BLOCK_MAX * MAX_PENDING_BLOCKS_EXT];
     int buflen = 0;
     double waketime;
     for (;;) {
         waketime = check_send_command(sq, buflen, eventtime);
-        if (waketime != PR_NOW || buflen + MESSAGE_MAX > sizeof(buf)) {
+        if (waketime != PR_NOW || buflen + sq->block_max > sizeof(buf)) {
             if (buflen) {
                 // Write message blocks
                 do_write(sq, buf, buflen);
@@ -599,41 +785,248 @@ command_event(struct serialqueue *sq, double eventtime)
     return waketime;
 }
 
-// Main background thread for reading/writing to serial port
+// Start servicing a serialqueue (called from background thread)
+static void
+serialthread_attach_queue(struct serialthread *st, struct serialqueue *sq)
+{
+    int slot;
+    for (slot=0; slot<st->max_queues; slot++)
+        if (!st->queues[slot])
+            break;
+    if (slot >= st->max_queues) {
+        errorf("No free slot in serial thread");
+        return;
+    }
+    st->queues[slot] = sq;
+    sq->st_slot = slot;
+    int fpos = STF_SLOTS + slot * SQPF_NUM, tpos = slot * SQPT_NUM;
+    pollreactor_add_fd(st->pr, fpos + SQPF_SERIAL, sq->serial_fd, input_event
+                       , sq, sq->serial_fd_type==SQT_DEBUGFILE);
+    pollreactor_add_fd(st->pr, fpos + SQPF_PIPE, sq->pipe_fds[0], kick_event
+                       , sq, 0);
+    pollreactor_add_timer(st->pr, tpos + SQPT_RETRANSMIT, retransmit_event
+                          , sq);
+    pollreactor_add_timer(st->pr, tpos + SQPT_COMMAND, command_event, sq);
+}
+
+// Callback for input activity on the control pipe (attach/detach)
+static void
+control_event(struct serialthread *st, double eventtime)
+{
+    char dummy[4096];
+    int ret = read(st->pipe_fds[0], dummy, sizeof(dummy));
+    if (ret < 0 && errno != EAGAIN)
+        report_errno("pipe read", ret);
+    pthread_mutex_lock(&st->lock);
+    while (!list_empty(&st->requests)) {
+        struct serialqueue *sq = list_first_entry(
+            &st->requests, struct serialqueue, st_node);
+        list_del(&sq->st_node);
+        if (sq->st_request == STR_ATTACH)
+            serialthread_attach_queue(st, sq);
+        else
+            serialthread_detach_queue(sq);
+        sq->st_request = 0;
+    }
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+}
+
+// Main background thread for reading/writing to serial ports
 static void *
 background_thread(void *data)
 {
-    struct serialqueue *sq = data;
-    pollreactor_run(sq->pr);
+    struct serialthread *st = data;
+    pthread_mutex_lock(&st->lock);
+    st->thread_id = syscall(SYS_gettid);
+    pthread_mutex_unlock(&st->lock);
 
-    pthread_mutex_lock(&sq->lock);
-    check_wake_receive(sq);
-    pthread_mutex_unlock(&sq->lock);
+    pollreactor_run(st->pr);
 
+    int i;
+    for (i=0; i<st->max_queues; i++)
+        if (st->queues[i])
+            serialthread_detach_queue(st->queues[i]);
+    pthread_mutex_lock(&st->lock);
+    st->is_exit = 1;
+    while (!list_empty(&st->requests)) {
+        struct serialqueue *sq = list_first_entry(
+            &st->requests, struct serialqueue, st_node);
+        list_del(&sq->st_node);
+        sq->st_request = 0;
+    }
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+
+    return NULL;
+}
+
+// Create a new background thread able to service 'max_queues'
+static struct serialthread *
+serialthread_alloc(int max_queues)
+{
+    struct serialthread *st = malloc(sizeof(*st));
+    memset(st, 0, sizeof(*st));
+    st->max_queues = max_queues;
+    st->queues = malloc(max_queues * sizeof(*st->queues));
+    memset(st->queues, 0, max_queues * sizeof(*st->queues));
+    list_init(&st->requests);
+
+    int ret = pipe(st->pipe_fds);
+    if (ret)
+        goto fail;
+
+    // Reactor setup
+    st->pr = pollreactor_alloc(STF_SLOTS + max_queues * SQPF_NUM
+                               , max_queues * SQPT_NUM);
+    pollreactor_add_fd(st->pr, STF_CONTROL, st->pipe_fds[0], control_event
+                       , st, 0);
+    fd_set_non_blocking(st->pipe_fds[0]);
+    fd_set_non_blocking(st->pipe_fds[1]);
+
+    // Thread setup
+    ret = pthread_mutex_init(&st->lock, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_cond_init(&st->cond, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_create(&st->tid, NULL, background_thread, st);
+    if (ret)
+        goto fail;
+
+    return st;
+
+fail:
+    report_errno("serialthread init", ret);
     return NULL;
 }
 
+// Stop a background thread and free its resources
+static void
+serialthread_free(struct serialthread *st)
+{
+    pollreactor_do_exit(st->pr);
+    int ret = write(st->pipe_fds[1], ".", 1);
+    if (ret < 0)
+        report_errno("pipe write", ret);
+    ret = pthread_join(st->tid, NULL);
+    if (ret)
+        report_errno("pthread_join", ret);
+    pollreactor_free(st->pr);
+    close(st->pipe_fds[0]);
+    close(st->pipe_fds[1]);
+    free(st->queues);
+    free(st);
+}
+
+// Ask the background thread to attach or detach a serialqueue and
+// wait for it to do so
+static void
+serialthread_request(struct serialthread *st, struct serialqueue *sq
+                     , int request)
+{
+    pthread_mutex_lock(&st->lock);
+    if (st->is_exit) {
+        pthread_mutex_unlock(&st->lock);
+        return;
+    }
+    sq->st_request = request;
+    list_add_tail(&sq->st_node, &st->requests);
+    int ret = write(st->pipe_fds[1], ".", 1);
+    if (ret < 0)
+        report_errno("pipe write", ret);
+    while (sq->st_request) {
+        ret = pthread_cond_wait(&st->cond, &st->lock);
+        if (ret)
+            report_errno("pthread_cond_wait", ret);
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+// Obtain a background thread to service a new serialqueue
+static struct serialthread *
+serialthread_acquire(int use_shared_thread)
+{
+    struct serialthread *st = NULL;
+    if (use_shared_thread) {
+        pthread_mutex_lock(&shared_serialthread_lock);
+        st = shared_serialthread;
+        if (!st)
+            st = shared_serialthread = serialthread_alloc(
+                SHARED_THREAD_MAX_QUEUES);
+        if (st && st->user_count >= st->max_queues) {
+            errorf("Too many users of shared serial thread");
+            st = NULL;
+        }
+        if (st)
+            st->user_count++;
+        pthread_mutex_unlock(&shared_serialthread_lock);
+    }
+    if (!st) {
+        st = serialthread_alloc(1);
+        if (st)
+            st->user_count = 1;
+    }
+    return st;
+}
+
+// Release a background thread obtained with serialthread_acquire()
+static void
+serialthread_release(struct serialthread *st)
+{
+    pthread_mutex_lock(&shared_serialthread_lock);
+    int users = --st->user_count;
+    if (!users && st == shared_serialthread)
+        shared_serialthread = NULL;
+    pthread_mutex_unlock(&shared_serialthread_lock);
+    if (!users)
+        serialthread_free(st);
+}
+
+// Report cpu time and context switches of a background thread
+static void
+serialthread_get_stats(struct serialthread *st, double *cpu_time
+                       , uint32_t *switches, uint32_t *preempts)
+{
+    *cpu_time = 0.;
+    *switches = *preempts = 0;
+    clockid_t cid;
+    struct timespec ts;
+    if (!pthread_getcpuclockid(st->tid, &cid) && !clock_gettime(cid, &ts))
+        *cpu_time = (double)ts.tv_sec + (double)ts.tv_nsec * .000000001;
+
+    pthread_mutex_lock(&st->lock);
+    int thread_id = st->thread_id;
+    pthread_mutex_unlock(&st->lock);
+    char fname[64], line[128];
+    snprintf(fname, sizeof(fname), "/proc/self/task/%d/status", thread_id);
+    FILE *f = fopen(fname, "r");
+    if (!f)
+        return;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "voluntary_ctxt_switches: %u", switches) == 1)
+            continue;
+        sscanf(line, "nonvoluntary_ctxt_switches: %u", preempts);
+    }
+    fclose(f);
+}
+
 // Create a new 'struct serialqueue' object
 struct serialqueue * __visible
-serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
+serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id
+                  , int use_shared_thread)
 {
     struct serialqueue *sq = malloc(sizeof(*sq));
     memset(sq, 0, sizeof(*sq));
     sq->serial_fd = serial_fd;
     sq->serial_fd_type = serial_fd_type;
     sq->client_id = client_id;
+    sq->st_slot = -1;
 
     int ret = pipe(sq->pipe_fds);
     if (ret)
         goto fail;
-
-    // Reactor setup
-    sq->pr = pollreactor_alloc(SQPF_NUM, SQPT_NUM, sq);
-    pollreactor_add_fd(sq->pr, SQPF_SERIAL, serial_fd, input_event
-                       , serial_fd_type==SQT_DEBUGFILE);
-    pollreactor_add_fd(sq->pr, SQPF_PIPE, sq->pipe_fds[0], kick_event, 0);
-    pollreactor_add_timer(sq->pr, SQPT_RETRANSMIT, retransmit_event);
-    pollreactor_add_timer(sq->pr, SQPT_COMMAND, command_event);
     fd_set_non_blocking(serial_fd);
     fd_set_non_blocking(sq->pipe_fds[0]);
     fd_set_non_blocking(sq->pipe_fds[1]);
@@ -650,6 +1043,7 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
     }
 
     // Queues
+    sq->block_max = MESSAGE_MAX;
     sq->need_kick_clock = MAX_CLOCK;
     list_init(&sq->pending_queues);
     list_init(&sq->sent_queue);
@@ -660,7 +1054,7 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
     // Debugging
     list_init(&sq->old_sent);
     list_init(&sq->old_receive);
-    debug_queue_alloc(&sq->old_sent, DEBUG_QUEUE_SENT);
+    debug_sent_alloc(&sq->old_sent, DEBUG_QUEUE_SENT);
     debug_queue_alloc(&sq->old_receive, DEBUG_QUEUE_RECEIVE);
 
     // Thread setup
@@ -673,9 +1067,12 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
     ret = pthread_mutex_init(&sq->fast_reader_dispatch_lock, NULL);
     if (ret)
         goto fail;
-    ret = pthread_create(&sq->tid, NULL, background_thread, sq);
-    if (ret)
+
+    // Start servicing the serial port
+    sq->st = serialthread_acquire(use_shared_thread);
+    if (!sq->st)
         goto fail;
+    serialthread_request(sq->st, sq, STR_ATTACH);
 
     return sq;
 
@@ -688,11 +1085,16 @@ fail:
 void __visible
 serialqueue_exit(struct serialqueue *sq)
 {
-    pollreactor_do_exit(sq->pr);
-    kick_bg_thread(sq);
-    int ret = pthread_join(sq->tid, NULL);
-    if (ret)
-        report_errno("pthread_join", ret);
+    struct serialthread *st = sq->st;
+    if (!st)
+        return;
+    serialthread_request(st, sq, STR_DETACH);
+    pthread_mutex_lock(&sq->lock);
+    sq->is_exit = 1;
+    sq->st = NULL;
+    check_wake_receive(sq);
+    pthread_mutex_unlock(&sq->lock);
+    serialthread_release(st);
 }
 
 // Free all resources associated with a serialqueue
@@ -701,13 +1103,12 @@ serialqueue_free(struct serialqueue *sq)
 {
     if (!sq)
         return;
-    if (!pollreactor_is_exit(sq->pr))
-        serialqueue_exit(sq);
+    serialqueue_exit(sq);
     pthread_mutex_lock(&sq->lock);
-    message_queue_free(&sq->sent_queue);
+    sent_block_queue_free(&sq->sent_queue);
     message_queue_free(&sq->receive_queue);
     message_queue_free(&sq->notify_queue);
-    message_queue_free(&sq->old_sent);
+    sent_block_queue_free(&sq->old_sent);
     message_queue_free(&sq->old_receive);
     while (!list_empty(&sq->pending_queues)) {
         struct command_queue *cq = list_first_entry(
@@ -717,7 +1118,8 @@ serialqueue_free(struct serialqueue *sq)
         message_queue_free(&cq->upcoming_queue);
     }
     pthread_mutex_unlock(&sq->lock);
-    pollreactor_free(sq->pr);
+    close(sq->pipe_fds[0]);
+    close(sq->pipe_fds[1]);
     free(sq);
 }
 
@@ -835,7 +1237,7 @@ serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm)
     pthread_mutex_lock(&sq->lock);
     // Wait for message to be available
     while (list_empty(&sq->receive_queue)) {
-        if (pollreactor_is_exit(sq->pr))
+        if (sq->is_exit)
             goto exit;
         sq->receive_waiting = 1;
         int ret = pthread_cond_wait(&sq->cond, &sq->lock);
@@ -888,6 +1290,58 @@ serialqueue_set_receive_window(struct serialqueue *sq, int receive_window)
     pthread_mutex_unlock(&sq->lock);
 }
 
+// Set the largest message block the mcu accepts
+void __visible
+serialqueue_set_block_max(struct serialqueue *sq, int block_max)
+{
+    if (block_max < MESSAGE_MAX)
+        block_max = MESSAGE_MAX;
+    else if (block_max > MESSAGE_BLOCK_MAX)
+        block_max = MESSAGE_BLOCK_MAX;
+    pthread_mutex_lock(&sq->lock);
+    sq->block_max = block_max;
+    pthread_mutex_unlock(&sq->lock);
+}
+
+// Use extended (6 bit) sequence numbers for all future message blocks.
+// If 'selective' is set then the mcu stores blocks received after a
+// lost block and only the lost blocks are retransmitted on a nak.
+void __visible
+serialqueue_set_extended_seq(struct serialqueue *sq, int selective)
+{
+    pthread_mutex_lock(&sq->lock);
+    if (!sq->ext_seq_start)
+        sq->ext_seq_start = sq->send_seq;
+    sq->selective = selective;
+    pthread_mutex_unlock(&sq->lock);
+}
+
+// Configure the scheduling of the background thread.  If 'cpu' is not
+// negative then the thread is only run on that cpu.  If 'priority' is
+// non-zero then the thread is run with SCHED_FIFO realtime priority.
+// Note that these settings apply to all users of a shared thread.
+void __visible
+serialqueue_set_thread_params(struct serialqueue *sq, int cpu, int priority)
+{
+    struct serialthread *st = sq->st;
+    if (!st)
+        return;
+    if (cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        int ret = pthread_setaffinity_np(st->tid, sizeof(cpuset), &cpuset);
+        if (ret)
+            report_errno("pthread_setaffinity_np", ret);
+    }
+    if (priority) {
+        struct sched_param sp = { .sched_priority = priority };
+        int ret = pthread_setschedparam(st->tid, SCHED_FIFO, &sp);
+        if (ret)
+            report_errno("pthread_setschedparam", ret);
+    }
+}
+
 // Set the estimated clock rate of the mcu on the other end of the
 // serial port
 void __visible
@@ -912,6 +1366,16 @@ serialqueue_get_clock_est(struct serialqueue *sq, struct clock_estimate *ce)
     pthread_mutex_unlock(&sq->lock);
 }
 
+// Return the current smoothed round-trip time estimate (and its variance)
+void
+serialqueue_get_rtt(struct serialqueue *sq, double *srtt, double *rttvar)
+{
+    pthread_mutex_lock(&sq->lock);
+    *srtt = sq->srtt;
+    *rttvar = sq->rttvar;
+    pthread_mutex_unlock(&sq->lock);
+}
+
 // Return a string buffer containing statistics for the serial port
 void __visible
 serialqueue_get_stats(struct serialqueue *sq, char *buf, int len)
@@ -920,18 +1384,25 @@ serialqueue_get_stats(struct serialqueue *sq, char *buf, int len)
     pthread_mutex_lock(&sq->lock);
     memcpy(&stats, sq, sizeof(stats));
     pthread_mutex_unlock(&sq->lock);
+    double thread_cpu = 0.;
+    uint32_t thread_switches = 0, thread_preempts = 0;
+    if (stats.st)
+        serialthread_get_stats(stats.st, &thread_cpu, &thread_switches
+                               , &thread_preempts);
 
     snprintf(buf, len, "bytes_write=%u bytes_read=%u"
              " bytes_retransmit=%u bytes_invalid=%u"
              " send_seq=%u receive_seq=%u retransmit_seq=%u"
              " srtt=%.3f rttvar=%.3f rto=%.3f"
              " ready_bytes=%u upcoming_bytes=%u"
+             " thread_cpu=%.3f thread_switches=%u thread_preempts=%u"
              , stats.bytes_write, stats.bytes_read
              , stats.bytes_retransmit, stats.bytes_invalid
              , (int)stats.send_seq, (int)stats.receive_seq
              , (int)stats.retransmit_seq
              , stats.srtt, stats.rttvar, stats.rto
-             , stats.ready_bytes, stats.upcoming_bytes);
+             , stats.ready_bytes, stats.upcoming_bytes
+             , thread_cpu, thread_switches, thread_preempts);
 }
 
 // Extract old messages stored in the debug queues
@@ -943,7 +1414,10 @@ serialqueue_extract_old(struct serialqueue *sq, int sentq
     struct list_head *rootp = sentq ? &sq->old_sent : &sq->old_receive;
     struct list_head replacement, current;
     list_init(&replacement);
-    debug_queue_alloc(&replacement, count);
+    if (sentq)
+        debug_sent_alloc(&replacement, count);
+    else
+        debug_queue_alloc(&replacement, count);
     list_init(&current);
 
     // Atomically replace existing debug list with new zero'd list
@@ -955,19 +1429,30 @@ serialqueue_extract_old(struct serialqueue *sq, int sentq
 
     // Walk the debug list
     int pos = 0;
-    while (!list_empty(&current)) {
-        struct queue_message *qm = list_first_entry(
-            &current, struct queue_message, node);
-        if (qm->len && pos < max) {
-            struct pull_queue_message *pqm = q++;
-            pos++;
-            memcpy(pqm->msg, qm->msg, qm->len);
-            pqm->len = qm->len;
-            pqm->sent_time = qm->sent_time;
-            pqm->receive_time = qm->receive_time;
+    if (sentq) {
+        struct sent_block *sb;
+        list_for_each_entry(sb, &current, node) {
+            if (sb->len && pos < max) {
+                struct pull_queue_message *pqm = &q[pos++];
+                memcpy(pqm->msg, sb->msg, sb->len);
+                pqm->len = sb->len;
+                pqm->sent_time = sb->sent_time;
+                pqm->receive_time = sb->receive_time;
+            }
         }
-        list_del(&qm->node);
-        message_free(qm);
+        sent_block_queue_free(&current);
+    } else {
+        struct queue_message *qm;
+        list_for_each_entry(qm, &current, node) {
+            if (qm->len && pos < max) {
+                struct pull_queue_message *pqm = &q[pos++];
+                memcpy(pqm->msg, qm->msg, qm->len);
+                pqm->len = qm->len;
+                pqm->sent_time = qm->sent_time;
+                pqm->receive_time = qm->receive_time;
+            }
+        }
+        message_queue_free(&current);
     }
     return pos;
 }
@@ -14,12 +14,14 @@ typedef void (*fastreader_cb)(struct fastreader *fr, uint8_t *data, int len);
 struct fastreader {
     struct list_node node;
     fastreader_cb func;
+    // If set, matching messages are not added to the receive queue
+    int exclusive;
     int prefix_len;
     uint8_t prefix[MESSAGE_MAX];
 };
 
 struct pull_queue_message {
-    uint8_t msg[MESSAGE_MAX];
+    uint8_t msg[MESSAGE_BLOCK_MAX];
     int len;
     double sent_time, receive_time;
     uint64_t notify_id;
@@ -27,7 +29,7 @@ struct pull_queue_message {
 
 struct serialqueue;
 struct serialqueue *serialqueue_alloc(int serial_fd, char serial_fd_type
-                                      , int client_id);
+                                      , int client_id, int use_shared_thread);
 void serialqueue_exit(struct serialqueue *sq);
 void serialqueue_free(struct serialqueue *sq);
 struct command_queue *serialqueue_alloc_commandqueue(void);
@@ -44,11 +46,16 @@ void serialqueue_send(struct serialqueue *sq, struct command_queue *cq
 void serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm);
 void serialqueue_set_wire_frequency(struct serialqueue *sq, double frequency);
 void serialqueue_set_receive_window(struct serialqueue *sq, int receive_window);
+void serialqueue_set_block_max(struct serialqueue *sq, int block_max);
+void serialqueue_set_extended_seq(struct serialqueue *sq, int selective);
+void serialqueue_set_thread_params(struct serialqueue *sq, int cpu
+                                  , int priority);
 void serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
                                , double conv_time, uint64_t conv_clock
                                , uint64_t last_clock);
 void serialqueue_get_clock_est(struct serialqueue *sq
                                , struct clock_estimate *ce);
+void serialqueue_get_rtt(struct serialqueue *sq, double *srtt, double *rttvar);
 void serialqueue_get_stats(struct serialqueue *sq, char *buf, int len);
 int serialqueue_extract_old(struct serialqueue *sq, int sentq
                             , struct pull_queue_message *q, int max);
@@ -39,7 +39,11 @@ struct stepcompress {
     struct list_head msg_queue;
     uint32_t oid;
     int32_t queue_step_msgtag, set_next_step_dir_msgtag;
+    int32_t queue_step_delta_msgtag;
     int sdir, invert_sdir;
+    // Delta encoding of queue_step intervals
+    uint32_t last_interval;
+    int have_last_interval;
     // Step+dir+step filter
     uint64_t next_step_clock;
     int next_step_dir;
@@ -256,14 +260,17 @@ stepcompress_alloc(uint32_t oid)
     return sc;
 }
 
-// Fill message id information
+// Fill message id information (queue_step_delta_msgtag may be -1 if
+// the mcu does not support that command)
 void __visible
 stepcompress_fill(struct stepcompress *sc, uint32_t max_error
-                  , int32_t queue_step_msgtag, int32_t set_next_step_dir_msgtag)
+                  , int32_t queue_step_msgtag, int32_t set_next_step_dir_msgtag
+                  , int32_t queue_step_delta_msgtag)
 {
     sc->max_error = max_error;
     sc->queue_step_msgtag = queue_step_msgtag;
     sc->set_next_step_dir_msgtag = set_next_step_dir_msgtag;
+    sc->queue_step_delta_msgtag = queue_step_delta_msgtag;
 }
 
 // Set the inverted stepper direction flag
@@ -340,6 +347,18 @@ stepcompress_set_time(struct stepcompress *sc
 // Maximium clock delta between messages in the queue
 #define CLOCK_DIFF_MAX (3<<28)
 
+// Return the number of bytes needed to encode an integer parameter
+static int
+encoded_size(uint32_t v)
+{
+    int32_t sv = v;
+    if (sv < (3L<<5)  && sv >= -(1L<<5))  return 1;
+    if (sv < (3L<<12) && sv >= -(1L<<12)) return 2;
+    if (sv < (3L<<19) && sv >= -(1L<<19)) return 3;
+    if (sv < (3L<<26) && sv >= -(1L<<26)) return 4;
+    return 5;
+}
+
 // Helper to create a queue_step command from a 'struct step_move'
 static void
 add_move(struct stepcompress *sc, uint64_t first_clock, struct step_move *move)
@@ -348,10 +367,19 @@ add_move(struct stepcompress *sc, uint64_t first_clock, struct step_move *move)
     uint32_t ticks = move->add*addfactor + move->interval*(move->count-1);
     uint64_t last_clock = first_clock + ticks;
 
-    // Create and queue a queue_step command
+    // Create and queue a queue_step (or queue_step_delta) command
     uint32_t msg[5] = {
         sc->queue_step_msgtag, sc->oid, move->interval, move->count, move->add
     };
+    uint32_t interval_delta = move->interval - sc->last_interval;
+    if (sc->have_last_interval && sc->queue_step_delta_msgtag >= 0
+        && encoded_size(interval_delta) < encoded_size(move->interval)) {
+        msg[0] = sc->queue_step_delta_msgtag;
+        msg[2] = interval_delta;
+    }
+    sc->last_interval = (move->interval
+                         + (int32_t)move->add * (uint16_t)(move->count - 1));
+    sc->have_last_interval = 1;
     struct queue_message *qm = message_alloc_and_encode(msg, 5);
     qm->min_clock = qm->req_clock = sc->last_step_clock;
     if (move->count == 1 && first_clock >= sc->last_step_clock + CLOCK_DIFF_MAX)
@@ -557,6 +585,7 @@ stepcompress_reset(struct stepcompress *sc, uint64_t last_step_clock)
         return ret;
     sc->last_step_clock = last_step_clock;
     sc->sdir = -1;
+    sc->have_last_interval = 0;
     calc_last_step_print_time(sc);
     return 0;
 }
@@ -32,9 +32,16 @@ struct trdispatch_mcu {
     // Remaining fields protected by trdispatch lock
     uint64_t last_status_clock, expire_clock;
     uint64_t expire_ticks, min_extend_ticks;
+    uint64_t trigger_clock;
+    double last_report_time, max_report_gap;
     struct clock_estimate ce;
 };
 
+struct pull_trdispatch_stats {
+    double srtt, rttvar, max_report_gap;
+    uint64_t trigger_clock;
+};
+
 // Send: trsync_trigger oid=%c reason=%c
 static void
 send_trsync_trigger(struct trdispatch_mcu *tdm)
@@ -74,6 +81,11 @@ handle_trsync_state(struct fastreader *fr, uint8_t *data, int len)
     // Process message
     struct trdispatch *td = tdm->td;
     pthread_mutex_lock(&td->lock);
+    if (!can_trigger && !tdm->trigger_clock && clock) {
+        // Note the time this mcu reported (or acted on) the trigger
+        serialqueue_get_clock_est(tdm->sq, &tdm->ce);
+        tdm->trigger_clock = clock_from_clock32(&tdm->ce, clock);
+    }
     if (!td->can_trigger)
         goto done;
 
@@ -87,6 +99,13 @@ handle_trsync_state(struct fastreader *fr, uint8_t *data, int len)
         goto done;
     }
 
+    // Track the largest interval between received status reports
+    double curtime = get_monotonic();
+    if (tdm->last_report_time
+        && curtime - tdm->last_report_time > tdm->max_report_gap)
+        tdm->max_report_gap = curtime - tdm->last_report_time;
+    tdm->last_report_time = curtime;
+
     // mcu is still working okay - update last_status_clock
     serialqueue_get_clock_est(tdm->sq, &tdm->ce);
     tdm->last_status_clock = clock_from_clock32(&tdm->ce, clock);
@@ -221,6 +240,22 @@ trdispatch_mcu_setup(struct trdispatch_mcu *tdm
     tdm->expire_clock = expire_clock;
     tdm->expire_ticks = expire_ticks;
     tdm->min_extend_ticks = min_extend_ticks;
+    tdm->trigger_clock = 0;
+    tdm->last_report_time = tdm->max_report_gap = 0.;
     serialqueue_get_clock_est(tdm->sq, &tdm->ce);
     pthread_mutex_unlock(&td->lock);
 }
+
+// Report the mcu round-trip time, the largest interval between status
+// reports, and the clock of its last trigger report
+void __visible
+trdispatch_mcu_get_stats(struct trdispatch_mcu *tdm
+                         , struct pull_trdispatch_stats *stats)
+{
+    serialqueue_get_rtt(tdm->sq, &stats->srtt, &stats->rttvar);
+    struct trdispatch *td = tdm->td;
+    pthread_mutex_lock(&td->lock);
+    stats->max_report_gap = tdm->max_report_gap;
+    stats->trigger_clock = tdm->trigger_clock;
+    pthread_mutex_unlock(&td->lock);
+}
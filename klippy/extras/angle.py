@@ -3,8 +3,8 @@
 # Copyright (C) 2021,2022  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, math, threading
-from . import bus, motion_report
+import logging, math
+from . import bus, motion_report, bulk_sensor
 
 MIN_MSG_TIME = 0.100
 TCODE_ERROR = 0xff
@@ -416,10 +416,7 @@ class Angle:
         self.calibration = AngleCalibration(config)
         # Measurement conversion
         self.start_clock = self.time_shift = self.sample_ticks = 0
-        self.last_sequence = self.last_angle = 0
-        # Measurement storage (accessed from background thread)
-        self.lock = threading.Lock()
-        self.raw_samples = []
+        self.last_angle = 0
         # Sensor type
         sensors = { "a1333": HelperA1333, "as5047d": HelperAS5047D,
                     "tle5012b": HelperTLE5012B }
@@ -439,8 +436,8 @@ class Angle:
             "query_spi_angle oid=%d clock=0 rest_ticks=0 time_shift=0"
             % (oid,), on_restart=True)
         mcu.register_config_callback(self._build_config)
-        mcu.register_response(self._handle_spi_angle_data,
-                              "spi_angle_data", oid)
+        self.bulk_queue = bulk_sensor.BulkDataQueue(
+            mcu, "spi_angle_data oid=%c sequence=%hu data=%*s", oid)
         # API server endpoints
         self.api_dump = motion_report.APIDumpHelper(
             self.printer, self._api_update, self._api_startstop, 0.100)
@@ -464,15 +461,11 @@ class Angle:
     # Measurement collection
     def is_measuring(self):
         return self.start_clock != 0
-    def _handle_spi_angle_data(self, params):
-        with self.lock:
-            self.raw_samples.append(params)
     def _extract_samples(self, raw_samples):
         # Load variables to optimize inner loop below
         sample_ticks = self.sample_ticks
         start_clock = self.start_clock
         clock_to_print_time = self.mcu.clock_to_print_time
-        last_sequence = self.last_sequence
         last_angle = self.last_angle
         time_shift = 0
         static_delay = 0.
@@ -488,12 +481,8 @@ class Angle:
         # Process every message in raw_samples
         count = error_count = 0
         samples = [None] * (len(raw_samples) * 16)
-        for params in raw_samples:
-            seq = (last_sequence & ~0xffff) | params['sequence']
-            if seq < last_sequence:
-                seq += 0x10000
-            last_sequence = seq
-            d = bytearray(params['data'])
+        for seq, data in raw_samples:
+            d = bytearray(data)
             msg_mclock = start_clock + seq*16*sample_ticks
             for i in range(len(d) // 3):
                 tcode = d[i*3]
@@ -518,7 +507,6 @@ class Angle:
                 ptime = round(clock_to_print_time(sclock) - static_delay, 6)
                 samples[count] = (ptime, last_angle)
                 count += 1
-        self.last_sequence = last_sequence
         self.last_angle = last_angle
         del samples[count:]
         return samples, error_count
@@ -526,9 +514,7 @@ class Angle:
     def _api_update(self, eventtime):
         if self.sensor_helper.is_tcode_absolute:
             self.sensor_helper.update_clock()
-        with self.lock:
-            raw_samples = self.raw_samples
-            self.raw_samples = []
+        raw_samples = self.bulk_queue.pull()
         if not raw_samples:
             return {}
         samples, error_count = self._extract_samples(raw_samples)
@@ -543,9 +529,7 @@ class Angle:
         logging.info("Starting angle '%s' measurements", self.name)
         self.sensor_helper.start()
         # Start bulk reading
-        with self.lock:
-            self.raw_samples = []
-        self.last_sequence = 0
+        self.bulk_queue.start()
         systime = self.printer.get_reactor().monotonic()
         print_time = self.mcu.estimated_print_time(systime) + MIN_MSG_TIME
         self.start_clock = reqclock = self.mcu.print_time_to_clock(print_time)
@@ -559,8 +543,7 @@ class Angle:
         # Halt bulk reading
         params = self.query_spi_angle_end_cmd.send([self.oid, 0, 0, 0])
         self.start_clock = 0
-        with self.lock:
-            self.raw_samples = []
+        self.bulk_queue.stop()
         self.sensor_helper.last_temperature = None
         logging.info("Stopped angle '%s' measurements", self.name)
     def _api_startstop(self, is_start):
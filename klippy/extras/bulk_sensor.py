@@ -0,0 +1,60 @@
+# Helper code for collecting high rate sensor data messages
+#
+# Copyright (C) 2026  agent <agent@local>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import logging
+import chelper
+
+MAX_BLOCKS = 4096
+PULL_BLOCKS = 256
+
+# Collect "<name>_data oid=%c sequence=%hu data=%*s" messages in C
+# code.  The messages are stored in a ring buffer by the serial
+# background thread and are only processed by python when pull() is
+# called.
+class BulkDataQueue:
+    def __init__(self, mcu, msgformat, oid, max_blocks=MAX_BLOCKS):
+        self.mcu = mcu
+        self.msgformat = msgformat
+        self.oid = oid
+        self.max_blocks = max_blocks
+        self.last_overflows = 0
+        self.ffi_main, self.ffi_lib = chelper.get_ffi()
+        self.blocks = self.ffi_main.new('struct bulkdata_block[%d]'
+                                        % (PULL_BLOCKS,))
+        self.bulkdata = None
+        mcu.register_config_callback(self._build_config)
+    def _build_config(self):
+        msgtag = self.mcu.lookup_command(self.msgformat).get_command_tag()
+        bulkdata = self.ffi_lib.bulkdata_alloc(
+            self.mcu._serial.get_serialqueue(), # XXX
+            msgtag, self.oid, self.max_blocks)
+        if bulkdata == self.ffi_main.NULL:
+            raise self.mcu.get_printer().config_error(
+                "Unable to setup sensor data collection for '%s'"
+                % (self.msgformat,))
+        self.bulkdata = self.ffi_main.gc(bulkdata, self.ffi_lib.bulkdata_free)
+    def start(self):
+        self.last_overflows = 0
+        self.ffi_lib.bulkdata_start(self.bulkdata)
+    def stop(self):
+        self.ffi_lib.bulkdata_stop(self.bulkdata)
+    # Return a list of (sequence, data) tuples for all stored messages.
+    # The sequence is extended to 64bits.
+    def pull(self):
+        ffi_main, ffi_lib = self.ffi_main, self.ffi_lib
+        blocks = self.blocks
+        samples = []
+        while 1:
+            count = ffi_lib.bulkdata_pull(self.bulkdata, blocks, PULL_BLOCKS)
+            samples.extend([(b.sequence, ffi_main.buffer(b.data, b.data_len)[:])
+                            for b in blocks[0:count]])
+            if count < PULL_BLOCKS:
+                break
+        overflows = ffi_lib.bulkdata_get_overflows(self.bulkdata)
+        if overflows != self.last_overflows:
+            logging.warning("Sensor oid %d discarded %d data messages",
+                            self.oid, overflows - self.last_overflows)
+            self.last_overflows = overflows
+        return samples
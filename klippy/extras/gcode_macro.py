@@ -11,12 +11,26 @@ import jinja2
 # Template handling
 ######################################################################
 
+# Status value types that are safe to share between template renders
+IMMUTABLE_TYPES = (type(None), bool, int, float, str, bytes)
+
+def _render_copy(val):
+    if isinstance(val, IMMUTABLE_TYPES):
+        return val
+    if (isinstance(val, tuple)
+        and all(isinstance(v, IMMUTABLE_TYPES) for v in val)):
+        return val
+    return copy.deepcopy(val)
+
 # Wrapper for access to printer object get_status() methods
 class GetStatusWrapper:
-    def __init__(self, printer, eventtime=None):
+    def __init__(self, printer, eventtime=None, snapshots=None):
         self.printer = printer
         self.eventtime = eventtime
         self.cache = {}
+        if snapshots is None:
+            snapshots = {}
+        self.snapshots = snapshots
     def __getitem__(self, val):
         sval = str(val).strip()
         if sval in self.cache:
@@ -24,9 +38,32 @@ class GetStatusWrapper:
         po = self.printer.lookup_object(sval, None)
         if po is None or not hasattr(po, 'get_status'):
             raise KeyError(val)
-        if self.eventtime is None:
-            self.eventtime = self.printer.get_reactor().monotonic()
-        self.cache[sval] = res = copy.deepcopy(po.get_status(self.eventtime))
+        eventtime = self.eventtime
+        if eventtime is None:
+            eventtime = self.eventtime = self.printer.get_reactor().monotonic()
+        # Reuse the last copy of the status if it is from the same
+        # eventtime.  Status values are immutable (a changed value is
+        # always a new object), so only new values need to be copied.
+        # The snapshot is shared between renders, so each render gets
+        # its own copy of any mutable (list or dict) values.
+        last = self.snapshots.get(sval)
+        if last is not None and last[0] == eventtime:
+            res = last[2]
+        else:
+            status = po.get_status(eventtime)
+            if last is None:
+                res = copy.deepcopy(status)
+            elif last[1] is status:
+                res = last[2]
+            else:
+                last_status, last_res = last[1], last[2]
+                res = {k: last_res[k] if (k in last_status
+                                          and last_status[k] is v)
+                       else copy.deepcopy(v)
+                       for k, v in status.items()}
+            self.snapshots[sval] = (eventtime, status, res)
+        res = {k: _render_copy(v) for k, v in res.items()}
+        self.cache[sval] = res
         return res
     def __contains__(self, val):
         try:
@@ -41,14 +78,17 @@ class GetStatusWrapper:
 
 # Wrapper around a Jinja2 template
 class TemplateWrapper:
-    def __init__(self, printer, env, name, script):
+    def __init__(self, printer, name, script):
         self.printer = printer
+        self.reactor = printer.get_reactor()
         self.name = name
         self.gcode = self.printer.lookup_object('gcode')
         gcode_macro = self.printer.lookup_object('gcode_macro')
         self.create_template_context = gcode_macro.create_template_context
+        self.render_count = 0
+        self.render_time = 0.
         try:
-            self.template = env.from_string(script)
+            self.template = gcode_macro.compile_template(script)
         except Exception as e:
             msg = "Error loading template '%s': %s" % (
                  name, traceback.format_exception_only(type(e), e)[-1])
@@ -57,6 +97,7 @@ class TemplateWrapper:
     def render(self, context=None):
         if context is None:
             context = self.create_template_context()
+        start_time = self.reactor.monotonic()
         try:
             return str(self.template.render(context))
         except Exception as e:
@@ -64,6 +105,9 @@ class TemplateWrapper:
                 self.name, traceback.format_exception_only(type(e), e)[-1])
             logging.exception(msg)
             raise self.gcode.error(msg)
+        finally:
+            self.render_count += 1
+            self.render_time += self.reactor.monotonic() - start_time
     def run_gcode_from_command(self, context=None):
         self.gcode.run_script_from_command(self.render(context))
 
@@ -72,13 +116,22 @@ class PrinterGCodeMacro:
     def __init__(self, config):
         self.printer = config.get_printer()
         self.env = jinja2.Environment('{%', '%}', '{', '}')
+        self.compiled_templates = {}
+        self.status_snapshots = {}
+    def compile_template(self, script):
+        # Templates with identical scripts share the compiled code
+        template = self.compiled_templates.get(script)
+        if template is None:
+            template = self.env.from_string(script)
+            self.compiled_templates[script] = template
+        return template
     def load_template(self, config, option, default=None):
         name = "%s:%s" % (config.get_name(), option)
         if default is None:
             script = config.get(option)
         else:
             script = config.get(option, default)
-        return TemplateWrapper(self.printer, self.env, name, script)
+        return TemplateWrapper(self.printer, name, script)
     def _action_emergency_stop(self, msg="action_emergency_stop"):
         self.printer.invoke_shutdown("Shutdown due to %s" % (msg,))
         return ""
@@ -96,7 +149,8 @@ class PrinterGCodeMacro:
         return ""
     def create_template_context(self, eventtime=None):
         return {
-            'printer': GetStatusWrapper(self.printer, eventtime),
+            'printer': GetStatusWrapper(self.printer, eventtime,
+                                        self.status_snapshots),
             'action_emergency_stop': self._action_emergency_stop,
             'action_respond_info': self._action_respond_info,
             'action_raise_error': self._action_raise_error,
@@ -140,6 +194,8 @@ class GCodeMacro:
                                         name, self.cmd_SET_GCODE_VARIABLE,
                                         desc=self.cmd_SET_GCODE_VARIABLE_help)
         self.in_script = False
+        self.status = None
+        self.status_count = 0
         self.variables = {}
         prefix = 'variable_'
         for option in config.get_prefix_options(prefix):
@@ -161,7 +217,15 @@ class GCodeMacro:
         self.gcode.register_command(self.rename_existing, prev_cmd, desc=pdesc)
         self.gcode.register_command(self.alias, self.cmd, desc=self.cmd_desc)
     def get_status(self, eventtime):
-        return self.variables
+        template = self.template
+        if self.status is None or self.status_count != template.render_count:
+            # Report render statistics (user variables take precedence)
+            status = {'render_count': template.render_count,
+                      'render_time': template.render_time}
+            status.update(self.variables)
+            self.status = status
+            self.status_count = template.render_count
+        return self.status
     cmd_SET_GCODE_VARIABLE_help = "Set the value of a G-Code macro variable"
     def cmd_SET_GCODE_VARIABLE(self, gcmd):
         variable = gcmd.get('VARIABLE')
@@ -177,6 +241,7 @@ class GCodeMacro:
         v = dict(self.variables)
         v[variable] = literal
         self.variables = v
+        self.status = None
     def cmd(self, gcmd):
         if self.in_script:
             raise gcmd.error("Macro %s called recursively" % (self.alias,))
@@ -4,6 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging
+import gcode
 
 class GCodeMove:
     def __init__(self, config):
@@ -141,6 +142,28 @@ class GCodeMove:
             raise gcmd.error("Unable to parse move '%s'"
                              % (gcmd.get_commandline(),))
         self.move_with_transform(self.last_position, self.speed)
+    def is_default_move_handler(self):
+        gcode_dispatch = self.printer.lookup_object('gcode')
+        return (gcode_dispatch.get_command_handler('G1') == self.cmd_G1
+                and gcode_dispatch.get_command_handler('G0') == self.cmd_G1)
+    def parsed_move(self, flags, params):
+        # Equivalent of cmd_G1() for moves pre-parsed by chelper gcodeparse
+        for pos in range(3):
+            if flags & (1 << pos):
+                v = params[pos]
+                if not self.absolute_coord:
+                    self.last_position[pos] += v
+                else:
+                    self.last_position[pos] = v + self.base_position[pos]
+        if flags & gcode.GP_E:
+            v = params[3] * self.extrude_factor
+            if not self.absolute_coord or not self.absolute_extrude:
+                self.last_position[3] += v
+            else:
+                self.last_position[3] = v + self.base_position[3]
+        if flags & gcode.GP_F:
+            self.speed = params[4] * self.speed_factor
+        self.move_with_transform(self.last_position, self.speed)
     # G-Code coordinate manipulation
     def cmd_G20(self, gcmd):
         # Set units to inches
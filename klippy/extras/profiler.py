@@ -0,0 +1,90 @@
+# Report time spent in reactor callbacks and g-code commands
+#
+# Copyright (C) 2026  agent <agent@local>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import logging
+import reactor
+
+LOG_TOP_COUNT = 5
+
+# Determine a descriptive name for a reactor callback
+def callback_name(callback):
+    obj = getattr(callback, '__self__', None)
+    if isinstance(obj, reactor.ReactorCallback):
+        # Report the function scheduled via register_callback()
+        callback = obj.callback
+        obj = getattr(callback, '__self__', None)
+    name = getattr(callback, '__qualname__', None)
+    if name is not None and '.' in name:
+        return name
+    name = getattr(callback, '__name__', repr(callback))
+    if obj is not None:
+        return "%s.%s" % (type(obj).__name__, name)
+    return name
+
+class Profiler:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.reactor = self.printer.get_reactor()
+        self.log_interval = config.getfloat('log_interval', 60., minval=0.)
+        self.callback_stats = {}
+        self.command_stats = {}
+        self.start_time = self.reactor.monotonic()
+        self.reactor.set_profiler(self)
+        self.printer.lookup_object('gcode').set_profiler(self)
+        self.printer.register_event_handler("klippy:ready", self._handle_ready)
+        self.printer.register_event_handler("klippy:disconnect",
+                                            self._handle_disconnect)
+        webhooks = self.printer.lookup_object('webhooks')
+        webhooks.register_endpoint("profiler/dump", self._handle_dump)
+    def _handle_ready(self):
+        if self.log_interval:
+            self.reactor.register_timer(
+                self._log_stats, self.reactor.monotonic() + self.log_interval)
+    def _handle_disconnect(self):
+        self.reactor.set_profiler(None)
+    # Stat collection (invoked from reactor and gcode)
+    def note_callback(self, callback, elapsed):
+        self._note(self.callback_stats, callback_name(callback), elapsed)
+    def note_command(self, cmd, elapsed):
+        self._note(self.command_stats, cmd, elapsed)
+    def _note(self, stats, name, elapsed):
+        s = stats.get(name)
+        if s is None:
+            stats[name] = [1, elapsed, elapsed]
+            return
+        s[0] += 1
+        s[1] += elapsed
+        if elapsed > s[2]:
+            s[2] = elapsed
+    # Reporting
+    def _format_top(self, stats):
+        top = sorted(stats.items(), key=lambda i: i[1][1], reverse=True)
+        return " ".join(["%s=%d/%.3f/%.6f" % (name, count, total, worst)
+                         for name, (count, total, worst)
+                         in top[:LOG_TOP_COUNT]])
+    def _log_stats(self, eventtime):
+        logging.info("Profile %.1f: callbacks: %s commands: %s",
+                     eventtime - self.start_time,
+                     self._format_top(self.callback_stats),
+                     self._format_top(self.command_stats))
+        return eventtime + self.log_interval
+    def _get_results(self, stats):
+        return {name: {'count': count, 'total_time': total,
+                       'max_time': worst}
+                for name, (count, total, worst) in stats.items()}
+    def _handle_dump(self, web_request):
+        reset = web_request.get_int('reset', 0)
+        eventtime = self.reactor.monotonic()
+        web_request.send({
+            'duration': eventtime - self.start_time,
+            'callbacks': self._get_results(self.callback_stats),
+            'commands': self._get_results(self.command_stats)})
+        if reset:
+            self.callback_stats = {}
+            self.command_stats = {}
+            self.start_time = eventtime
+
+def load_config(config):
+    return Profiler(config)
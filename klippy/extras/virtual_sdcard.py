@@ -3,9 +3,13 @@
 # Copyright (C) 2018  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, logging, io
+import os, logging, io, mmap, threading
+import chelper, gcode
 
-VALID_GCODE_EXTS = ['gcode', 'g', 'gco']
+VALID_GCODE_EXTS = ['gcode', 'g', 'gco', 'kgc']
+MOVE_BATCH = 64
+PARSE_WINDOW = 64 * 1024
+YIELD_BYTES = 8192
 
 class VirtualSD:
     def __init__(self, config):
@@ -16,7 +20,12 @@ class VirtualSD:
         sd = config.get('path')
         self.sdcard_dirname = os.path.normpath(os.path.expanduser(sd))
         self.current_file = None
+        self.file_data = self.file_ptr = None
         self.file_position = self.file_size = 0
+        # Size and mtime of a memory mapped file (None if not mapped)
+        self.file_stat = None
+        # Binary g-code files store records between binary_start/end
+        self.binary_start = self.binary_end = 0
         # Print Stat Tracking
         self.print_stats = self.printer.load_object(config, 'print_stats')
         # Work timer
@@ -24,6 +33,15 @@ class VirtualSD:
         self.must_pause_work = self.cmd_from_sd = False
         self.next_file_position = 0
         self.work_timer = None
+        # Fast path for plain G0/G1 moves
+        self.fast_moves = config.getboolean('fast_moves', True)
+        self.gcode_move = self.printer.load_object(config, 'gcode_move')
+        self.ffi_main, self.ffi_lib = chelper.get_ffi()
+        self.parsed_moves = self.ffi_main.new('struct gcode_move[%d]'
+                                              % (MOVE_BATCH,))
+        # Line index (built in a background thread)
+        self.file_index = self.pending_index = None
+        self.index_thread = self.index_completion = None
         # Error handling
         gcode_macro = self.printer.load_object(config, 'gcode_macro')
         self.on_error_gcode = gcode_macro.load_template(
@@ -46,8 +64,7 @@ class VirtualSD:
             try:
                 readpos = max(self.file_position - 1024, 0)
                 readcount = self.file_position - readpos
-                self.current_file.seek(readpos)
-                data = self.current_file.read(readcount + 128)
+                data = self.file_data[readpos:readpos + readcount + 128]
             except:
                 logging.exception("virtual_sdcard shutdown read")
                 return
@@ -90,6 +107,8 @@ class VirtualSD:
             'is_active': self.is_active(),
             'file_position': self.file_position,
             'file_size': self.file_size,
+            'file_line': self.file_line(),
+            'file_line_count': self.file_line_count(),
         }
     def file_path(self):
         if self.current_file:
@@ -100,6 +119,15 @@ class VirtualSD:
             return float(self.file_position) / self.file_size
         else:
             return 0.
+    def file_line(self):
+        if self.file_index is None:
+            return None
+        return self.ffi_lib.gcodeindex_offset_to_line(
+            self.file_index, self.file_ptr, int(self.file_position)) + 1
+    def file_line_count(self):
+        if self.file_index is None:
+            return None
+        return self.ffi_lib.gcodeindex_get_line_count(self.file_index)
     def is_active(self):
         return self.work_timer is not None
     def do_pause(self):
@@ -116,8 +144,7 @@ class VirtualSD:
     def do_cancel(self):
         if self.current_file is not None:
             self.do_pause()
-            self.current_file.close()
-            self.current_file = None
+            self._close_file()
             self.print_stats.note_cancel()
         self.file_position = self.file_size = 0.
     # G-Code commands
@@ -126,8 +153,7 @@ class VirtualSD:
     def _reset_file(self):
         if self.current_file is not None:
             self.do_pause()
-            self.current_file.close()
-            self.current_file = None
+            self._close_file()
         self.file_position = self.file_size = 0.
         self.print_stats.reset()
         self.printer.send_event("virtual_sdcard:reset_file")
@@ -145,9 +171,12 @@ class VirtualSD:
             raise gcmd.error("SD busy")
         self._reset_file()
         filename = gcmd.get("FILENAME")
+        line = gcmd.get_int("LINE", None, minval=1)
         if filename[0] == '/':
             filename = filename[1:]
         self._load_file(gcmd, filename, check_subdirs=True)
+        if line is not None:
+            self.file_position = self._find_line(gcmd, line)
         self.do_resume()
     def cmd_M20(self, gcmd):
         # List SD card
@@ -177,19 +206,113 @@ class VirtualSD:
             if fname not in flist:
                 fname = files_by_lower[fname.lower()]
             fname = os.path.join(self.sdcard_dirname, fname)
-            f = io.open(fname, 'r', newline='')
+            f = io.open(fname, 'rb')
             f.seek(0, os.SEEK_END)
             fsize = f.tell()
             f.seek(0)
+            data = b""
+            st = os.fstat(f.fileno())
+            if fsize:
+                data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
         except:
             logging.exception("virtual_sdcard file open")
             raise gcmd.error("Unable to open file")
         gcmd.respond_raw("File opened:%s Size:%d" % (filename, fsize))
         gcmd.respond_raw("File selected")
         self.current_file = f
+        self.file_data = data
+        self.file_ptr = self.ffi_main.from_buffer(data)
         self.file_position = 0
-        self.file_size = fsize
+        self.file_size = len(data)
+        self.file_stat = None
+        if fsize:
+            self.file_stat = (st.st_size, st.st_mtime_ns)
+        self.binary_start = self.binary_end = 0
+        magic = gcode.BINARY_GCODE_START + b"\n"
+        if data[:len(magic)] == magic:
+            self.binary_start = len(magic)
+            self.binary_end = self.file_size
         self.print_stats.set_current_file(filename)
+        if not self.binary_start:
+            self._start_index()
+    def _close_file(self):
+        self._stop_index()
+        self.file_ptr = self.file_data = self.file_stat = None
+        self.current_file.close()
+        self.current_file = None
+    def _check_file(self):
+        # Accessing the memory mapping of a file that has been truncated
+        # (eg, overwritten by a new upload) raises SIGBUS, so check for
+        # changes before using it and switch to a copy of the file
+        # (read with read()) if it has changed.
+        if self.file_stat is None:
+            return
+        st = os.fstat(self.current_file.fileno())
+        if (st.st_size, st.st_mtime_ns) == self.file_stat:
+            return
+        logging.warning("virtual_sdcard: file changed while in use")
+        self._stop_index()
+        f = self.current_file
+        f.seek(0)
+        data = f.read(self.file_size)
+        self.file_data = data
+        self.file_ptr = self.ffi_main.from_buffer(data)
+        self.file_stat = None
+        self.file_size = len(data)
+        self.binary_end = min(self.binary_end, self.file_size)
+        if not self.binary_start:
+            self._start_index()
+    # Line index support
+    def _start_index(self):
+        ffi_main, ffi_lib = self.ffi_main, self.ffi_lib
+        gi = ffi_main.gc(ffi_lib.gcodeindex_alloc(), ffi_lib.gcodeindex_free)
+        self.pending_index = gi
+        self.index_completion = self.reactor.completion()
+        self.index_thread = threading.Thread(
+            target=self._index_thread, args=(gi, self.file_ptr,
+                                             self.current_file.fileno(),
+                                             self.file_size))
+        self.index_thread.daemon = True
+        self.index_thread.start()
+    def _stop_index(self):
+        if self.index_thread is not None:
+            self.ffi_lib.gcodeindex_abort(self.pending_index)
+            self.index_thread.join()
+        self.file_index = self.pending_index = None
+        self.index_thread = None
+        if self.index_completion is not None:
+            self.index_completion.complete(None)
+            self.index_completion = None
+    def _index_thread(self, gi, file_ptr, fd, file_size):
+        # Background thread - the gil is released while indexing
+        ret = self.ffi_lib.gcodeindex_build(gi, fd, file_size)
+        if ret:
+            gi = None
+        self.reactor.register_async_callback(
+            lambda e: self._index_done(gi, file_ptr))
+    def _index_done(self, gi, file_ptr):
+        if file_ptr is not self.file_ptr:
+            # File was closed while indexing
+            return
+        self.index_thread.join()
+        self.index_thread = None
+        self.file_index = gi
+        if gi is not None:
+            logging.info("virtual_sdcard: indexed %d lines",
+                         self.ffi_lib.gcodeindex_get_line_count(gi))
+        self.index_completion.complete(gi)
+    def _find_line(self, gcmd, line):
+        self._check_file()
+        gi = self.file_index
+        if gi is None and self.index_completion is not None:
+            gi = self.index_completion.wait()
+        if gi is None:
+            raise gcmd.error("Unable to index file")
+        offset = self.ffi_lib.gcodeindex_line_to_offset(
+            gi, self.file_ptr, line - 1)
+        if offset < 0:
+            raise gcmd.error("Line %d is past the end of the file" % (line,))
+        return offset
     def cmd_M24(self, gcmd):
         # Start/resume SD print
         self.do_resume()
@@ -219,36 +342,19 @@ class VirtualSD:
     def work_handler(self, eventtime):
         logging.info("Starting SD card print (position %d)", self.file_position)
         self.reactor.unregister_timer(self.work_timer)
-        try:
-            self.current_file.seek(self.file_position)
-        except:
-            logging.exception("virtual_sdcard seek")
+        if self.current_file is None:
+            logging.info("virtual_sdcard: no file selected")
             self.work_timer = None
             return self.reactor.NEVER
         self.print_stats.note_start()
         gcode_mutex = self.gcode.get_mutex()
-        partial_input = ""
-        lines = []
+        data = self.file_data
+        yield_position = self.file_position + YIELD_BYTES
         error_message = None
         while not self.must_pause_work:
-            if not lines:
-                # Read more data
-                try:
-                    data = self.current_file.read(8192)
-                except:
-                    logging.exception("virtual_sdcard read")
-                    break
-                if not data:
-                    # End of file
-                    self.current_file.close()
-                    self.current_file = None
-                    logging.info("Finished SD card print")
-                    self.gcode.respond_raw("Done printing file")
-                    break
-                lines = data.split('\n')
-                lines[0] = partial_input + lines[0]
-                partial_input = lines.pop()
-                lines.reverse()
+            # Periodically let other reactor tasks run
+            if self.file_position >= yield_position:
+                yield_position = self.file_position + YIELD_BYTES
                 self.reactor.pause(self.reactor.NOW)
                 continue
             # Pause if any other request is pending in the gcode class
@@ -257,10 +363,30 @@ class VirtualSD:
                 continue
             # Dispatch command
             self.cmd_from_sd = True
-            line = lines.pop()
-            next_file_position = self.file_position + len(line) + 1
-            self.next_file_position = next_file_position
             try:
+                self._check_file()
+                data = self.file_data
+                pos = self.file_position
+                if pos < self.binary_end:
+                    line, next_file_position = self._next_binary_command()
+                    if line is None:
+                        self.cmd_from_sd = False
+                        continue
+                else:
+                    if self.fast_moves and self._run_parsed_moves(
+                            self.ffi_lib.gcodeparse_moves):
+                        self.cmd_from_sd = False
+                        continue
+                    line_end = data.find(b'\n', pos)
+                    if line_end < 0:
+                        # End of file
+                        self._close_file()
+                        logging.info("Finished SD card print")
+                        self.gcode.respond_raw("Done printing file")
+                        break
+                    line = data[pos:line_end].decode()
+                    next_file_position = line_end + 1
+                self.next_file_position = next_file_position
                 self.gcode.run_script(line)
             except self.gcode.error as e:
                 error_message = str(e)
@@ -276,14 +402,7 @@ class VirtualSD:
             self.file_position = self.next_file_position
             # Do we need to skip around?
             if self.next_file_position != next_file_position:
-                try:
-                    self.current_file.seek(self.file_position)
-                except:
-                    logging.exception("virtual_sdcard seek")
-                    self.work_timer = None
-                    return self.reactor.NEVER
-                lines = []
-                partial_input = ""
+                yield_position = self.file_position + YIELD_BYTES
         logging.info("Exiting SD card print (position %d)", self.file_position)
         self.work_timer = None
         self.cmd_from_sd = False
@@ -294,6 +413,55 @@ class VirtualSD:
         else:
             self.print_stats.note_complete()
         return self.reactor.NEVER
+    def _next_binary_command(self):
+        # Process the next record(s) of a binary g-code file.  Returns
+        # the text of a command to run (and its end position) or None.
+        if self.file_position < self.binary_start:
+            # Skip file header
+            self.file_position = self.binary_start
+            return None, None
+        if self._run_parsed_moves(self.ffi_lib.gcodeparse_binary_moves):
+            return None, None
+        pos = self.file_position
+        moves = self.parsed_moves
+        if self.ffi_lib.gcodeparse_binary_moves(
+                self.file_ptr + pos, self.binary_end - pos, moves, 1):
+            # Moves are redirected - run them through the g-code parser
+            pmove = moves[0]
+            return (gcode.binary_move_to_text(pmove.flags, pmove.params),
+                    pos + pmove.length)
+        op, line, next_pos = gcode.parse_binary_record(self.file_data, pos)
+        if op == gcode.BG_OP_TEXT:
+            return line, next_pos
+        if op != gcode.BG_OP_END:
+            raise self.gcode.error(
+                "Invalid binary g-code record at file position %d" % (pos,))
+        # Remainder of file is regular g-code
+        self.binary_end = self.file_position = next_pos
+        return None, None
+    def _run_parsed_moves(self, parse_func):
+        # Run consecutive plain G0/G1 commands without the g-code parser
+        if not self.gcode_move.is_default_move_handler():
+            return 0
+        pos = self.file_position
+        window = min(self.file_size - pos, PARSE_WINDOW)
+        if window <= 0:
+            return 0
+        moves = self.parsed_moves
+        count = parse_func(self.file_ptr + pos, window, moves, MOVE_BATCH)
+        gcode_mutex = self.gcode.get_mutex()
+        run_parsed_command = self.gcode.run_parsed_command
+        parsed_move = self.gcode_move.parsed_move
+        for i in range(count):
+            if self.must_pause_work or gcode_mutex.test():
+                return i
+            pmove = moves[i]
+            next_file_position = self.file_position + pmove.length
+            self.next_file_position = next_file_position
+            cmd = "G0" if pmove.flags & gcode.GP_G0 else "G1"
+            run_parsed_command(cmd, parsed_move, pmove.flags, pmove.params)
+            self.file_position = next_file_position
+        return count
 
 def load_config(config):
     return VirtualSD(config)
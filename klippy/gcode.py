@@ -10,6 +10,75 @@ class CommandError(Exception):
 
 Coord = collections.namedtuple('Coord', ('x', 'y', 'z', 'e'))
 
+# Parameter flags reported by chelper gcodeparse
+GP_E, GP_F, GP_G0 = 1<<3, 1<<4, 1<<5
+
+# Compact binary g-code stream support (see scripts/gcode_to_binary.py)
+BINARY_GCODE_START = b"\x7fKGC1"
+BG_OP_END, BG_OP_TEXT, BG_OP_MOVE = 0x00, 0x01, 0x80
+BG_MOVE_FLAGS = 0x3f
+BG_MAX_MOVE_SIZE = 64
+BG_MAX_TEXT_SIZE = 64 * 1024
+BINARY_BATCH = 64
+
+# Return the position after the varint at 'pos' (or None if incomplete)
+def _skip_varint(data, pos):
+    while pos < len(data):
+        c = ord(data[pos:pos+1])
+        pos += 1
+        if not c & 0x80:
+            return pos
+    return None
+
+# Parse a binary record - returns (opcode, text, next_pos).  The
+# opcode is None if the record is incomplete and next_pos is None if
+# the record is not valid (and its length can not be determined).
+def parse_binary_record(data, pos):
+    if pos >= len(data):
+        return None, None, pos
+    op = ord(data[pos:pos+1])
+    if op >= BG_OP_MOVE:
+        if op & ~(BG_OP_MOVE | BG_MOVE_FLAGS):
+            return op, None, None
+        # Move parameters are not decoded here (see chelper gcodeparse)
+        p = pos + 1
+        for i in range(5):
+            if op & (1<<i):
+                p = _skip_varint(data, p)
+                if p is None:
+                    return None, None, pos
+        return op, None, p
+    if op == BG_OP_END:
+        return op, None, pos + 1
+    if op != BG_OP_TEXT:
+        return op, None, None
+    length = 0
+    p = _skip_varint(data, pos + 1)
+    if p is None:
+        if len(data) - pos > 4:
+            # Length varint too long to be valid
+            return op, None, None
+        return None, None, pos
+    for i, c in enumerate(bytearray(data[pos+1:p])):
+        length |= (c & 0x7f) << (i * 7)
+    if length > BG_MAX_TEXT_SIZE:
+        return op, None, None
+    if p + length > len(data):
+        return None, None, pos
+    return op, data[p:p+length].decode(), p + length
+
+# Convert a binary move record back to an equivalent line of g-code
+def binary_move_to_text(flags, params):
+    parts = ["G0" if flags & GP_G0 else "G1"]
+    for i, axis in enumerate("XYZEF"):
+        if flags & (1<<i):
+            v = repr(params[i])
+            if 'e' in v:
+                # Binary values have at most 7 decimal places
+                v = "%.7f" % (params[i],)
+            parts.append(axis + v)
+    return " ".join(parts)
+
 class GCodeCommand:
     error = CommandError
     def __init__(self, gcode, command, commandline, params, need_ack):
@@ -104,6 +173,7 @@ class GCodeDispatch:
         self.ready_gcode_handlers = {}
         self.mux_commands = {}
         self.gcode_help = {}
+        self.profiler = None
         # Register commands needed before config file is loaded
         handlers = ['M110', 'M112', 'M115',
                     'RESTART', 'FIRMWARE_RESTART', 'ECHO', 'STATUS', 'HELP']
@@ -154,10 +224,23 @@ class GCodeDispatch:
                 "mux command %s %s %s already registered (%s)" % (
                     cmd, key, value, prev_values))
         prev_values[value] = func
+    def get_command_handler(self, cmd):
+        return self.gcode_handlers.get(cmd)
     def get_command_help(self):
         return dict(self.gcode_help)
     def register_output_handler(self, cb):
         self.output_callbacks.append(cb)
+    def set_profiler(self, profiler):
+        self.profiler = profiler
+    def _profile_command(self, cmd, func, *args):
+        reactor = self.printer.get_reactor()
+        start = reactor.monotonic()
+        try:
+            func(*args)
+        finally:
+            profiler = self.profiler
+            if profiler is not None:
+                profiler.note_command(cmd, reactor.monotonic() - start)
     def _handle_shutdown(self):
         if not self.is_printer_ready:
             return
@@ -195,7 +278,10 @@ class GCodeDispatch:
             # Invoke handler for command
             handler = self.gcode_handlers.get(cmd, self.cmd_default)
             try:
-                handler(gcmd)
+                if self.profiler is None:
+                    handler(gcmd)
+                else:
+                    self._profile_command(cmd, handler, gcmd)
             except self.error as e:
                 self._respond_error(str(e))
                 self.printer.send_event("gcode:command_error")
@@ -209,6 +295,29 @@ class GCodeDispatch:
                 if not need_ack:
                     raise
             gcmd.ack()
+    def _run_parsed_command(self, cmd, func, *args, **kw):
+        # Invoke a handler for a command that was parsed by the caller
+        need_ack = kw.get('need_ack', False)
+        try:
+            if self.profiler is None:
+                func(*args)
+            else:
+                self._profile_command(cmd, func, *args)
+        except self.error as e:
+            self._respond_error(str(e))
+            self.printer.send_event("gcode:command_error")
+            if not need_ack:
+                raise
+        except:
+            msg = 'Internal error on command:"%s"' % (cmd,)
+            logging.exception(msg)
+            self.printer.invoke_shutdown(msg)
+            self._respond_error(msg)
+            if not need_ack:
+                raise
+    def run_parsed_command(self, cmd, func, *args):
+        with self.mutex:
+            self._run_parsed_command(cmd, func, *args)
     def run_script_from_command(self, script):
         self._process_commands(script.split('\n'), need_ack=False)
     def run_script(self, script):
@@ -371,12 +480,17 @@ class GCodeIO:
             self.gcode.register_output_handler(self._respond_raw)
             self.fd_handle = self.reactor.register_fd(self.fd,
                                                       self._process_data)
-        self.partial_input = ""
+        self.partial_input = b""
         self.pending_commands = []
         self.bytes_read = 0
         self.input_log = collections.deque([], 50)
+        # Binary g-code input
+        self.is_binary_input = False
+        self.ffi_main = self.ffi_lib = self.binary_moves = None
+        self.gcode_move = None
     def _handle_ready(self):
         self.is_printer_ready = True
+        self.gcode_move = self.printer.lookup_object('gcode_move', None)
         if self.is_fileinput and self.fd_handle is None:
             self.fd_handle = self.reactor.register_fd(self.fd,
                                                       self._process_data)
@@ -393,19 +507,117 @@ class GCodeIO:
         self._dump_debug()
         if self.is_fileinput:
             self.printer.request_exit('error_exit')
+    def _start_binary(self):
+        self.is_binary_input = True
+        if self.binary_moves is None:
+            import chelper
+            self.ffi_main, self.ffi_lib = chelper.get_ffi()
+            self.binary_moves = self.ffi_main.new('struct gcode_move[%d]'
+                                                  % (BINARY_BATCH,))
+    def _split_binary(self, data, pos, commands):
+        # Decode binary records - returns new position (or None if done)
+        moves = self.binary_moves
+        count = self.ffi_lib.gcodeparse_binary_moves(
+            self.ffi_main.from_buffer(data) + pos, len(data) - pos,
+            moves, BINARY_BATCH)
+        for i in range(count):
+            pmove = moves[i]
+            commands.append((pmove.flags, list(pmove.params)))
+            pos += pmove.length
+        if count:
+            return pos
+        op, text, next_pos = parse_binary_record(data, pos)
+        if op is None:
+            if (ord(data[pos:pos+1]) >= BG_OP_MOVE
+                and len(data) - pos >= BG_MAX_MOVE_SIZE):
+                # Move record too long to be valid
+                next_pos = None
+            else:
+                # Need more data
+                return None
+        if next_pos is None:
+            # The stream can not be resynchronized - discard it
+            self.is_binary_input = False
+            commands.append((None, "Invalid binary g-code record"
+                             " - discarding binary input"))
+            return len(data)
+        if op == BG_OP_TEXT:
+            commands.append(text)
+        elif op == BG_OP_END:
+            self.is_binary_input = False
+        else:
+            # Complete move record rejected by the parser (eg, F<=0)
+            commands.append((None, "Invalid binary g-code move"))
+        return next_pos
+    def _split_input(self, data):
+        # Separate input into text lines and binary move records
+        data = self.partial_input + data
+        commands = []
+        pos = 0
+        while pos < len(data):
+            if self.is_binary_input:
+                next_pos = self._split_binary(data, pos, commands)
+                if next_pos is None:
+                    break
+                pos = next_pos
+                continue
+            line_end = data.find(b'\n', pos)
+            if line_end < 0:
+                break
+            line = data[pos:line_end]
+            pos = line_end + 1
+            if line.rstrip() == BINARY_GCODE_START:
+                self._start_binary()
+                continue
+            try:
+                commands.append(str(line.decode()))
+            except UnicodeDecodeError:
+                logging.exception("Read g-code")
+        self.partial_input = data[pos:]
+        return commands
+    def _run_binary_move(self, flags, params):
+        # Binary moves are acknowledged the same as a line of text
+        if flags is None:
+            # Invalid record (params contains the error message)
+            self.gcode._respond_error(params)
+            self.gcode.respond_raw("ok")
+            return
+        gcode_move = self.gcode_move
+        if gcode_move is None or not gcode_move.is_default_move_handler():
+            # Use the regular g-code handler (eg, a G1 gcode_macro)
+            line = binary_move_to_text(flags, params)
+            self.gcode._process_commands([line])
+            return
+        cmd = "G0" if flags & GP_G0 else "G1"
+        self.gcode._run_parsed_command(cmd, gcode_move.parsed_move,
+                                       flags, params, need_ack=True)
+        self.gcode.respond_raw("ok")
+    def _run_commands(self, commands):
+        # Text lines are sent to the g-code parser, binary moves are
+        # run directly
+        text_start = 0
+        for i, cmd in enumerate(commands):
+            if type(cmd) is not tuple:
+                continue
+            if text_start < i:
+                self.gcode._process_commands(commands[text_start:i])
+            text_start = i + 1
+            self._run_binary_move(*cmd)
+        if not text_start:
+            self.gcode._process_commands(commands)
+        elif text_start < len(commands):
+            self.gcode._process_commands(commands[text_start:])
     m112_r = re.compile('^(?:[nN][0-9]+)?\s*[mM]112(?:\s|$)')
     def _process_data(self, eventtime):
         # Read input, separate by newline, and add to pending_commands
         try:
-            data = str(os.read(self.fd, 4096).decode())
-        except (os.error, UnicodeDecodeError):
+            data = os.read(self.fd, 4096)
+        except os.error:
             logging.exception("Read g-code")
             return
         self.input_log.append((eventtime, data))
         self.bytes_read += len(data)
-        lines = data.split('\n')
-        lines[0] = self.partial_input + lines[0]
-        self.partial_input = lines.pop()
+        lines = self._split_input(data)
         pending_commands = self.pending_commands
         pending_commands.extend(lines)
         self.pipe_is_active = True
@@ -421,7 +633,8 @@ class GCodeIO:
             if len(pending_commands) < 20:
                 # Check for M112 out-of-order
                 for line in lines:
-                    if self.m112_r.match(line) is not None:
+                    if (type(line) is not tuple
+                        and self.m112_r.match(line) is not None):
                         self.gcode.cmd_M112(None)
             if self.is_processing_data:
                 if len(pending_commands) >= 20:
@@ -434,7 +647,7 @@ class GCodeIO:
         while pending_commands:
             self.pending_commands = []
             with self.gcode_mutex:
-                self.gcode._process_commands(pending_commands)
+                self._run_commands(pending_commands)
             pending_commands = self.pending_commands
         self.is_processing_data = False
         if self.fd_handle is None:
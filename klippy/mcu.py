@@ -3,7 +3,7 @@
 # Copyright (C) 2016-2023  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import sys, os, zlib, logging, math
+import sys, os, zlib, logging, math, bisect
 import serialhdl, msgproto, pins, chelper, clocksync
 
 class error(Exception):
@@ -115,6 +115,8 @@ class MCU_trsync:
         self._stepper_stop_cmd = None
         self._trigger_completion = None
         self._home_end_clock = None
+        self._report_time = 0.
+        self._report_jitter = None
         mcu.register_config_callback(self._build_config)
         printer = mcu.get_printer()
         printer.register_event_handler("klippy:shutdown", self._shutdown)
@@ -189,8 +191,10 @@ class MCU_trsync:
         clock = self._mcu.print_time_to_clock(print_time)
         expire_ticks = self._mcu.seconds_to_clock(expire_timeout)
         expire_clock = clock + expire_ticks
-        report_ticks = self._mcu.seconds_to_clock(expire_timeout * .4)
-        min_extend_ticks = self._mcu.seconds_to_clock(expire_timeout * .4 * .8)
+        report_time = self._report_time = expire_timeout * TRSYNC_REPORT_RATIO
+        report_ticks = self._mcu.seconds_to_clock(report_time)
+        min_extend_ticks = self._mcu.seconds_to_clock(
+            report_time * TRSYNC_EXTEND_RATIO)
         ffi_main, ffi_lib = chelper.get_ffi()
         ffi_lib.trdispatch_mcu_setup(self._trdispatch_mcu, clock, expire_clock,
                                      expire_ticks, min_extend_ticks)
@@ -204,6 +208,44 @@ class MCU_trsync:
                                           reqclock=expire_clock)
     def set_home_end_time(self, home_end_time):
         self._home_end_clock = self._mcu.print_time_to_clock(home_end_time)
+    def _get_stats(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        stats = ffi_main.new('struct pull_trdispatch_stats *')
+        ffi_lib.trdispatch_mcu_get_stats(self._trdispatch_mcu, stats)
+        return stats
+    def _note_report_jitter(self, reason):
+        # Track how late status reports arrived at the host
+        if reason == self.REASON_COMMS_TIMEOUT:
+            self._report_jitter = None
+            return
+        max_report_gap = self._get_stats().max_report_gap
+        if not max_report_gap:
+            return
+        jitter = max(0., max_report_gap - self._report_time)
+        if self._report_jitter is not None:
+            jitter = max(jitter, self._report_jitter)
+        self._report_jitter = jitter
+    def get_adaptive_timeout(self):
+        # Determine the smallest timeout that tolerates the measured
+        # round-trip time and report jitter of the mcu.  The mcu may not
+        # receive a new timeout until a report interval, plus the
+        # minimum timeout extension, plus a round-trip after the last
+        # extension.
+        if not self._mcu.get_trsync_adaptive() or self._mcu.is_fileoutput():
+            return None
+        stats = self._get_stats()
+        if not stats.srtt or self._report_jitter is None:
+            return None
+        rtt = stats.srtt + 4. * stats.rttvar
+        delay = rtt + 2. * self._report_jitter + TRSYNC_ADAPTIVE_MARGIN
+        slack = 1. - TRSYNC_REPORT_RATIO * (1. + TRSYNC_EXTEND_RATIO)
+        return delay / slack
+    def get_trigger_print_time(self):
+        # Return the time the mcu acted on the last trigger (or None)
+        trigger_clock = self._get_stats().trigger_clock
+        if not trigger_clock:
+            return None
+        return self._mcu.clock_to_print_time(trigger_clock)
     def stop(self):
         self._mcu.register_response(None, "trsync_state", self._oid)
         self._trigger_completion = None
@@ -213,10 +255,16 @@ class MCU_trsync:
                                               self.REASON_HOST_REQUEST])
         for s in self._steppers:
             s.note_homing_end()
-        return params['trigger_reason']
+        reason = params['trigger_reason']
+        self._note_report_jitter(reason)
+        return reason
 
 TRSYNC_TIMEOUT = 0.025
 TRSYNC_SINGLE_MCU_TIMEOUT = 0.250
+TRSYNC_REPORT_RATIO = .4
+TRSYNC_EXTEND_RATIO = .8
+TRSYNC_ADAPTIVE_MARGIN = 0.0005
+TRSYNC_LATENCY_BUCKETS = [.00025, .0005, .001, .002, .004, .008, .016, .032]
 
 class MCU_endstop:
     RETRY_QUERY = 1.000
@@ -230,6 +278,8 @@ class MCU_endstop:
         self._mcu.register_config_callback(self._build_config)
         self._trigger_completion = None
         self._rest_ticks = 0
+        self._expire_timeout = 0.
+        self._latency_hist = [0] * (len(TRSYNC_LATENCY_BUCKETS) + 1)
         ffi_main, ffi_lib = chelper.get_ffi()
         self._trdispatch = ffi_main.gc(ffi_lib.trdispatch_alloc(), ffi_lib.free)
         self._trsyncs = [MCU_trsync(mcu, self._trdispatch)]
@@ -281,6 +331,11 @@ class MCU_endstop:
         expire_timeout = TRSYNC_TIMEOUT
         if len(self._trsyncs) == 1:
             expire_timeout = TRSYNC_SINGLE_MCU_TIMEOUT
+        else:
+            timeouts = [t.get_adaptive_timeout() for t in self._trsyncs]
+            if None not in timeouts:
+                expire_timeout = min(max(timeouts), TRSYNC_TIMEOUT)
+        self._expire_timeout = expire_timeout
         for trsync in self._trsyncs:
             trsync.start(print_time, self._trigger_completion, expire_timeout)
         etrsync = self._trsyncs[0]
@@ -309,7 +364,31 @@ class MCU_endstop:
             return home_end_time
         params = self._query_cmd.send([self._oid])
         next_clock = self._mcu.clock32_to_clock64(params['next_clock'])
-        return self._mcu.clock_to_print_time(next_clock - self._rest_ticks)
+        trigger_time = self._mcu.clock_to_print_time(next_clock
+                                                     - self._rest_ticks)
+        self._note_trigger_latency(trigger_time)
+        return trigger_time
+    def _note_trigger_latency(self, trigger_time):
+        # Log the time from endstop trigger until other mcus stopped
+        latencies = []
+        for trsync in self._trsyncs[1:]:
+            stop_time = trsync.get_trigger_print_time()
+            if stop_time is None:
+                continue
+            latency = stop_time - trigger_time
+            self._latency_hist[bisect.bisect(TRSYNC_LATENCY_BUCKETS,
+                                             latency)] += 1
+            latencies.append("%s=%.3fms" % (trsync.get_mcu().get_name(),
+                                            latency * 1000.))
+        if not latencies:
+            return
+        hist = ["<%.2fms:%d" % (b * 1000., c) for b, c in
+                zip(TRSYNC_LATENCY_BUCKETS, self._latency_hist)]
+        hist.append(">=%.2fms:%d" % (TRSYNC_LATENCY_BUCKETS[-1] * 1000.,
+                                     self._latency_hist[-1]))
+        logging.info("Homing trigger to stop latency (timeout %.3fms): %s"
+                     " histogram: %s", self._expire_timeout * 1000.,
+                     " ".join(latencies), " ".join(hist))
     def query_endstop(self, print_time):
         clock = self._mcu.print_time_to_clock(print_time)
         if self._mcu.is_fileoutput():
@@ -576,6 +655,14 @@ class MCU:
             if not (self._serialport.startswith("/dev/rpmsg_")
                     or self._serialport.startswith("/tmp/klipper_host_")):
                 self._baud = config.getint('baud', 250000, minval=2400)
+        thread_cpu = config.getint('serial_thread_cpu', -1, minval=-1)
+        thread_priority = config.getint('serial_thread_priority', 0,
+                                        minval=0, maxval=99)
+        thread_shared = config.getboolean('serial_thread_shared', False)
+        self._serial.set_thread_params(thread_cpu, thread_priority,
+                                       thread_shared)
+        self._trsync_adaptive = config.getboolean('trsync_adaptive_timeout',
+                                                  False)
         # Restarts
         restart_methods = [None, 'arduino', 'cheetah', 'command', 'rpi_usb']
         self._restart_method = 'command'
@@ -610,6 +697,9 @@ class MCU:
         self._mcu_tick_avg = 0.
         self._mcu_tick_stddev = 0.
         self._mcu_tick_awake = 0.
+        self._mcu_move_min_free = None
+        self._histogram_names = []
+        self._histograms = {}
         # Register handlers
         printer.register_event_handler("klippy:firmware_restart",
                                        self._firmware_restart)
@@ -628,6 +718,40 @@ class MCU:
         diff = count*tick_sumsq - tick_sum**2
         self._mcu_tick_stddev = c * math.sqrt(max(0., diff))
         self._mcu_tick_awake = tick_sum / self._mcu_freq
+        self._mcu_move_min_free = params.get('move_min_free')
+    def _handle_histogram(self, params):
+        names = self._histogram_names
+        hid = params['id']
+        if hid >= len(names):
+            return
+        data = bytearray(params['counts'])
+        counts = [data[i] | (data[i+1] << 8) for i in range(0, len(data), 2)]
+        self._histograms[names[hid]] = counts
+        totals = dict(self._get_status_info['histograms'])
+        totals[names[hid]] = [t + c for t, c in zip(totals[names[hid]],
+                                                    counts)]
+        self._get_status_info['histograms'] = totals
+        if hid != len(names) - 1:
+            return
+        # Log the non-empty buckets of each histogram in this report
+        out = []
+        for name in names:
+            counts = self._histograms.get(name, [])
+            out.append("%s=%s" % (name, ",".join(
+                ["%d:%d" % (i, c) for i, c in enumerate(counts) if c])))
+        logging.info("MCU '%s' histograms: %s", self._name, " ".join(out))
+    def _setup_histograms(self, msgparser, tasks):
+        self._histogram_names = ['timer_lateness', 'timer_irq']
+        self._histogram_names.extend(tasks.split(','))
+        buckets = msgparser.get_constant_int('STATS_HISTOGRAM_BUCKETS')
+        shift = msgparser.get_constant_int('STATS_HISTOGRAM_SHIFT')
+        # Lower bound (in seconds) of each histogram bucket
+        bounds = [0.] + [(1 << (shift + i - 1)) / self._mcu_freq
+                         for i in range(1, buckets)]
+        self._get_status_info['histogram_bounds'] = bounds
+        self._get_status_info['histograms'] = {
+            name: [0] * buckets for name in self._histogram_names}
+        self.register_response(self._handle_histogram, 'stats_histogram')
     def _handle_shutdown(self, params):
         if self._is_shutdown:
             return
@@ -829,6 +953,9 @@ class MCU:
         self.register_response(self._handle_shutdown, 'shutdown')
         self.register_response(self._handle_shutdown, 'is_shutdown')
         self.register_response(self._handle_mcu_stats, 'stats')
+        hist_tasks = msgparser.get_constant('STATS_HISTOGRAM_TASKS', None)
+        if hist_tasks is not None:
+            self._setup_histograms(msgparser, hist_tasks)
     # Config creation helpers
     def setup_pin(self, pin_type, pin_params):
         pcs = {'endstop': MCU_endstop,
@@ -860,6 +987,8 @@ class MCU:
         return int(time * self._mcu_freq)
     def get_max_stepper_error(self):
         return self._max_stepper_error
+    def get_trsync_adaptive(self):
+        return self._trsync_adaptive
     # Wrapper functions
     def get_printer(self):
         return self._printer
@@ -984,6 +1113,8 @@ class MCU:
     def stats(self, eventtime):
         load = "mcu_awake=%.03f mcu_task_avg=%.06f mcu_task_stddev=%.06f" % (
             self._mcu_tick_awake, self._mcu_tick_avg, self._mcu_tick_stddev)
+        if self._mcu_move_min_free is not None:
+            load += " mcu_move_min_free=%d" % (self._mcu_move_min_free,)
         stats = ' '.join([load, self._serial.stats(eventtime),
                           self._clocksync.stats(eventtime)])
         parts = [s.split('=', 1) for s in stats.split()]
@@ -21,6 +21,8 @@ MESSAGE_TRAILER_SYNC = 1
 MESSAGE_PAYLOAD_MAX = MESSAGE_MAX - MESSAGE_MIN
 MESSAGE_SEQ_MASK = 0x0f
 MESSAGE_DEST = 0x10
+MESSAGE_SEQ_EXT = 0x80
+MESSAGE_SEQ_EXT_MASK = 0x60
 MESSAGE_SYNC = 0x7e
 
 class error(Exception):
@@ -248,6 +250,8 @@ class MessageParser:
         if msglen < MESSAGE_MIN or msglen > MESSAGE_MAX:
             return -1
         msgseq = s[MESSAGE_POS_SEQ]
+        if msgseq & MESSAGE_SEQ_EXT:
+            msgseq &= ~(MESSAGE_SEQ_EXT | MESSAGE_SEQ_EXT_MASK)
         if (msgseq & ~MESSAGE_SEQ_MASK) != MESSAGE_DEST:
             return -1
         if len(s) < msglen:
@@ -419,6 +423,8 @@ class MessageParser:
         return self.version, self.build_versions
     def get_messages(self):
         return list(self.messages)
+    def get_message_formats(self):
+        return dict(self.messages_by_id)
     def get_enumerations(self):
         return dict(self.enumerations)
     def get_constants(self):
@@ -3,7 +3,7 @@
 # Copyright (C) 2016-2020  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, gc, select, math, time, logging, queue
+import os, gc, select, math, time, logging, queue, heapq
 import greenlet
 import chelper, util
 
@@ -14,6 +14,8 @@ class ReactorTimer:
     def __init__(self, callback, waketime):
         self.callback = callback
         self.waketime = waketime
+        self.heap_entry = None
+        self.unregistered = False
 
 class ReactorCompletion:
     class sentinel: pass
@@ -101,8 +103,12 @@ class SelectReactor:
         # Python garbage collection
         self._check_gc = gc_checking
         self._last_gc_times = [0., 0., 0.]
-        # Timers
-        self._timers = []
+        # Timers (stored in a heap of (waketime, sequence, timer) entries -
+        # an entry is only valid if it matches the timer's heap_entry)
+        self._timer_heap = []
+        self._timer_sequence = 0
+        self._timer_count = 0
+        self._ready_timers = []
         self._next_timer = self.NEVER
         # Callbacks
         self._pipe_fds = None
@@ -114,24 +120,61 @@ class SelectReactor:
         self._g_dispatch = None
         self._greenlets = []
         self._all_greenlets = []
+        # Profiling
+        self._profiler = None
     def get_gc_stats(self):
         return tuple(self._last_gc_times)
+    # Profiling
+    def set_profiler(self, profiler):
+        self._profiler = profiler
+    def _profile_callback(self, callback, eventtime):
+        # Only callbacks that run to completion (without pausing) are timed
+        g_dispatch = self._g_dispatch
+        start = self.monotonic()
+        res = callback(eventtime)
+        profiler = self._profiler
+        if g_dispatch is self._g_dispatch and profiler is not None:
+            profiler.note_callback(callback, self.monotonic() - start)
+        return res
     # Timers
+    def _schedule_timer(self, timer_handler):
+        waketime = timer_handler.waketime
+        if waketime >= self.NEVER or timer_handler.unregistered:
+            timer_handler.heap_entry = None
+            return
+        self._timer_sequence += 1
+        entry = (waketime, self._timer_sequence, timer_handler)
+        timer_handler.heap_entry = entry
+        heap = self._timer_heap
+        heapq.heappush(heap, entry)
+        if len(heap) > 4 * self._timer_count + 64:
+            # Discard stale entries
+            heap = [e for e in heap if e[2].heap_entry is e]
+            heapq.heapify(heap)
+            self._timer_heap = heap
     def update_timer(self, timer_handler, waketime):
         timer_handler.waketime = waketime
+        self._schedule_timer(timer_handler)
         self._next_timer = min(self._next_timer, waketime)
     def register_timer(self, callback, waketime=NEVER):
         timer_handler = ReactorTimer(callback, waketime)
-        timers = list(self._timers)
-        timers.append(timer_handler)
-        self._timers = timers
+        self._timer_count += 1
+        self._schedule_timer(timer_handler)
         self._next_timer = min(self._next_timer, waketime)
         return timer_handler
     def unregister_timer(self, timer_handler):
         timer_handler.waketime = self.NEVER
-        timers = list(self._timers)
-        timers.pop(timers.index(timer_handler))
-        self._timers = timers
+        timer_handler.heap_entry = None
+        if timer_handler.unregistered:
+            return
+        timer_handler.unregistered = True
+        self._timer_count -= 1
+    def _requeue_ready_timers(self):
+        # Return timers not yet run in this pass to the heap
+        ready = self._ready_timers
+        for entry in ready:
+            heapq.heappush(self._timer_heap, entry)
+        del ready[:]
     def _check_timers(self, eventtime, busy):
         if eventtime < self._next_timer:
             if busy:
@@ -149,18 +192,37 @@ class SelectReactor:
                     gc.collect(gc_level)
                     return 0.
             return min(1., max(.001, self._next_timer - eventtime))
-        self._next_timer = self.NEVER
+        # Extract all expired timers (each timer is run at most once per pass)
+        heap = self._timer_heap
+        ready = self._ready_timers
+        while heap and heap[0][0] <= eventtime:
+            entry = heapq.heappop(heap)
+            if entry[2].heap_entry is entry:
+                ready.append(entry)
+        ready.reverse()
         g_dispatch = self._g_dispatch
-        for t in self._timers:
-            waketime = t.waketime
-            if eventtime >= waketime:
-                t.waketime = self.NEVER
-                t.waketime = waketime = t.callback(eventtime)
-                if g_dispatch is not self._g_dispatch:
-                    self._next_timer = min(self._next_timer, waketime)
-                    self._end_greenlet(g_dispatch)
-                    return 0.
-            self._next_timer = min(self._next_timer, waketime)
+        while ready:
+            entry = ready.pop()
+            t = entry[2]
+            if t.heap_entry is not entry:
+                # Timer was updated or unregistered by an earlier callback
+                continue
+            t.heap_entry = None
+            t.waketime = self.NEVER
+            if self._profiler is None:
+                t.waketime = t.callback(eventtime)
+            else:
+                t.waketime = self._profile_callback(t.callback, eventtime)
+            self._schedule_timer(t)
+            if g_dispatch is not self._g_dispatch:
+                self._next_timer = min(self._next_timer, t.waketime)
+                self._end_greenlet(g_dispatch)
+                return 0.
+        # Determine next wakeup time
+        heap = self._timer_heap
+        while heap and heap[0][2].heap_entry is not heap[0]:
+            heapq.heappop(heap)
+        self._next_timer = heap[0][0] if heap else self.NEVER
         return 0.
     # Callbacks and Completions
     def completion(self):
@@ -220,6 +282,7 @@ class SelectReactor:
             self._all_greenlets.append(g_next)
         g_next.parent = g.parent
         g.timer = self.register_timer(g.switch, waketime)
+        self._requeue_ready_timers()
         self._next_timer = self.NOW
         # Switch to _dispatch_loop (via _end_greenlet or direct)
         eventtime = g_next.switch()
@@ -270,14 +333,20 @@ class SelectReactor:
             eventtime = self.monotonic()
             for fd in res[0]:
                 busy = True
-                fd.read_callback(eventtime)
+                if self._profiler is None:
+                    fd.read_callback(eventtime)
+                else:
+                    self._profile_callback(fd.read_callback, eventtime)
                 if g_dispatch is not self._g_dispatch:
                     self._end_greenlet(g_dispatch)
                     eventtime = self.monotonic()
                     break
             for fd in res[1]:
                 busy = True
-                fd.write_callback(eventtime)
+                if self._profiler is None:
+                    fd.write_callback(eventtime)
+                else:
+                    self._profile_callback(fd.write_callback, eventtime)
                 if g_dispatch is not self._g_dispatch:
                     self._end_greenlet(g_dispatch)
                     eventtime = self.monotonic()
@@ -344,13 +413,21 @@ class PollReactor(SelectReactor):
             for fd, event in res:
                 busy = True
                 if event & (select.POLLIN | select.POLLHUP):
-                    self._fds[fd].read_callback(eventtime)
+                    if self._profiler is None:
+                        self._fds[fd].read_callback(eventtime)
+                    else:
+                        self._profile_callback(self._fds[fd].read_callback,
+                                               eventtime)
                     if g_dispatch is not self._g_dispatch:
                         self._end_greenlet(g_dispatch)
                         eventtime = self.monotonic()
                         break
                 if event & select.POLLOUT:
-                    self._fds[fd].write_callback(eventtime)
+                    if self._profiler is None:
+                        self._fds[fd].write_callback(eventtime)
+                    else:
+                        self._profile_callback(self._fds[fd].write_callback,
+                                               eventtime)
                     if g_dispatch is not self._g_dispatch:
                         self._end_greenlet(g_dispatch)
                         eventtime = self.monotonic()
@@ -395,13 +472,21 @@ class EPollReactor(SelectReactor):
             for fd, event in res:
                 busy = True
                 if event & (select.EPOLLIN | select.EPOLLHUP):
-                    self._fds[fd].read_callback(eventtime)
+                    if self._profiler is None:
+                        self._fds[fd].read_callback(eventtime)
+                    else:
+                        self._profile_callback(self._fds[fd].read_callback,
+                                               eventtime)
                     if g_dispatch is not self._g_dispatch:
                         self._end_greenlet(g_dispatch)
                         eventtime = self.monotonic()
                         break
                 if event & select.EPOLLOUT:
-                    self._fds[fd].write_callback(eventtime)
+                    if self._profiler is None:
+                        self._fds[fd].write_callback(eventtime)
+                    else:
+                        self._profile_callback(self._fds[fd].write_callback,
+                                               eventtime)
                     if g_dispatch is not self._g_dispatch:
                         self._end_greenlet(g_dispatch)
                         eventtime = self.monotonic()
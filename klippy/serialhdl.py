@@ -11,6 +11,40 @@ import msgproto, chelper, util
 class error(Exception):
     pass
 
+# Conversion of a response decoded by the C code to a params dictionary
+class ResponseFormat:
+    def __init__(self, msgformat):
+        self.name = msgformat.name
+        self.param_names = [name for name, t in msgformat.param_names]
+        self.param_count = len(self.param_names)
+        self.buffers = []
+        self.enums = []
+        ptypes = []
+        for name, t in msgformat.param_names:
+            if t.is_dynamic_string:
+                self.buffers.append(name)
+                ptypes.append('s')
+                continue
+            if not t.is_int:
+                self.enums.append((name, t.reverse_enums))
+                t = t.pt
+            ptypes.append('i' if t.signed else 'u')
+        self.param_types = ''.join(ptypes).encode()
+    def convert(self, values, msgbuf):
+        params = dict(zip(self.param_names, values[0:self.param_count]))
+        for name in self.buffers:
+            v = params[name]
+            offset = v & 0xffff
+            params[name] = msgbuf[offset:offset + (v >> 16)]
+        for name, reverse_enums in self.enums:
+            v = params[name]
+            tv = reverse_enums.get(v)
+            if tv is None:
+                tv = "?%d" % (v,)
+            params[name] = tv
+        params['#name'] = self.name
+        return params
+
 class SerialReader:
     def __init__(self, reactor, warn_prefix=""):
         self.reactor = reactor
@@ -21,8 +55,12 @@ class SerialReader:
         # C interface
         self.ffi_main, self.ffi_lib = chelper.get_ffi()
         self.serialqueue = None
+        self.thread_cpu = -1
+        self.thread_priority = 0
+        self.thread_shared = False
         self.default_cmd_queue = self.alloc_command_queue()
         self.stats_buf = self.ffi_main.new('char[4096]')
+        self.response_decoder = self._create_decoder(self.msgparser)
         # Threading
         self.lock = threading.Lock()
         self.background_thread = None
@@ -33,8 +71,26 @@ class SerialReader:
         # Sent message notification tracking
         self.last_notify_id = 0
         self.pending_notifications = {}
+    def _create_decoder(self, msgparser):
+        # Setup the C code response parser for the given data dictionary
+        ffi_main, ffi_lib = self.ffi_main, self.ffi_lib
+        cparser = ffi_main.gc(ffi_lib.msgparser_alloc(),
+                              ffi_lib.msgparser_free)
+        formats = {}
+        for msgid, msgformat in msgparser.get_message_formats().items():
+            if not isinstance(msgformat, msgproto.MessageFormat):
+                # Debug output messages are handled by msgparser
+                continue
+            rf = ResponseFormat(msgformat)
+            if ffi_lib.msgparser_add_format(cparser, msgid, rf.param_types):
+                continue
+            formats[msgid] = rf
+        return cparser, formats
     def _bg_thread(self):
         response = self.ffi_main.new('struct pull_queue_message *')
+        msgbuf = self.ffi_main.buffer(response.msg)
+        values = self.ffi_main.new('int64_t[%d]' % (msgproto.MESSAGE_MAX,))
+        msgparser_parse = self.ffi_lib.msgparser_parse
         while 1:
             self.ffi_lib.serialqueue_pull(self.serialqueue, response)
             count = response.len
@@ -46,14 +102,18 @@ class SerialReader:
                 completion = self.pending_notifications.pop(response.notify_id)
                 self.reactor.async_complete(completion, params)
                 continue
-            params = self.msgparser.parse(response.msg[0:count])
+            cparser, formats = self.response_decoder
+            msgid = msgparser_parse(cparser, response.msg, count, values)
+            if msgid >= 0:
+                params = formats[msgid].convert(values, msgbuf)
+            else:
+                params = self.msgparser.parse(response.msg[0:count])
             params['#sent_time'] = response.sent_time
             params['#receive_time'] = response.receive_time
             hdl = (params['#name'], params.get('oid'))
             try:
-                with self.lock:
-                    hdl = self.handlers.get(hdl, self.handle_default)
-                    hdl(params)
+                hdl = self.handlers.get(hdl, self.handle_default)
+                hdl(params)
             except:
                 logging.exception("%sException in serial callback",
                                   self.warn_prefix)
@@ -80,8 +140,12 @@ class SerialReader:
         self.serial_dev = serial_dev
         self.serialqueue = self.ffi_main.gc(
             self.ffi_lib.serialqueue_alloc(serial_dev.fileno(),
-                                           serial_fd_type, client_id),
+                                           serial_fd_type, client_id,
+                                           self.thread_shared),
             self.ffi_lib.serialqueue_free)
+        if self.thread_cpu >= 0 or self.thread_priority:
+            self.ffi_lib.serialqueue_set_thread_params(
+                self.serialqueue, self.thread_cpu, self.thread_priority)
         self.background_thread = threading.Thread(target=self._bg_thread)
         self.background_thread.start()
         # Obtain and load the data dictionary from the firmware
@@ -94,6 +158,7 @@ class SerialReader:
         msgparser = msgproto.MessageParser(warn_prefix=self.warn_prefix)
         msgparser.process_identify(identify_data)
         self.msgparser = msgparser
+        self.response_decoder = self._create_decoder(msgparser)
         self.register_response(self.handle_unknown, '#unknown')
         # Setup baud adjust
         if serial_fd_type == b'c':
@@ -107,7 +172,19 @@ class SerialReader:
         if receive_window is not None:
             self.ffi_lib.serialqueue_set_receive_window(
                 self.serialqueue, receive_window)
+        block_max = msgparser.get_constant_int('RECEIVE_BLOCK_MAX', None)
+        if block_max is not None:
+            self.ffi_lib.serialqueue_set_block_max(self.serialqueue, block_max)
+        seq_bits = msgparser.get_constant_int('RECEIVE_SEQ_BITS', 4)
+        if seq_bits >= 6:
+            reorder = msgparser.get_constant_int('RECEIVE_REORDER_BLOCKS', 0)
+            self.ffi_lib.serialqueue_set_extended_seq(self.serialqueue,
+                                                      reorder > 0)
         return True
+    def set_thread_params(self, cpu=-1, priority=0, shared=False):
+        self.thread_cpu = cpu
+        self.thread_priority = priority
+        self.thread_shared = shared
     def connect_canbus(self, canbus_uuid, canbus_nodeid, canbus_iface="can0"):
         import can # XXX
         txid = canbus_nodeid * 2 + 256
@@ -198,8 +275,10 @@ class SerialReader:
     def connect_file(self, debugoutput, dictionary, pace=False):
         self.serial_dev = debugoutput
         self.msgparser.process_identify(dictionary, decompress=False)
+        self.response_decoder = self._create_decoder(self.msgparser)
         self.serialqueue = self.ffi_main.gc(
-            self.ffi_lib.serialqueue_alloc(self.serial_dev.fileno(), b'f', 0),
+            self.ffi_lib.serialqueue_alloc(self.serial_dev.fileno(),
+                                           b'f', 0, False),
             self.ffi_lib.serialqueue_free)
     def set_clock_est(self, freq, conv_time, conv_clock, last_clock):
         self.ffi_lib.serialqueue_set_clock_est(
@@ -232,11 +311,15 @@ class SerialReader:
         return self.default_cmd_queue
     # Serial response callbacks
     def register_response(self, callback, name, oid=None):
+        # The handler table is replaced (never modified) so that the
+        # background thread may read it without taking the lock
         with self.lock:
+            handlers = dict(self.handlers)
             if callback is None:
-                del self.handlers[name, oid]
+                del handlers[name, oid]
             else:
-                self.handlers[name, oid] = callback
+                handlers[name, oid] = callback
+            self.handlers = handlers
     # Command sending
     def raw_send(self, cmd, minclock, reqclock, cmd_queue):
         self.ffi_lib.serialqueue_send(self.serialqueue, cmd_queue,
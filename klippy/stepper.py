@@ -93,6 +93,11 @@ class MCU_stepper:
             "queue_step oid=%c interval=%u count=%hu add=%hi").get_command_tag()
         dir_cmd_tag = self._mcu.lookup_command(
             "set_next_step_dir oid=%c dir=%c").get_command_tag()
+        step_delta_cmd = self._mcu.try_lookup_command(
+            "queue_step_delta oid=%c interval_delta=%i count=%hu add=%hi")
+        step_delta_cmd_tag = -1
+        if step_delta_cmd is not None:
+            step_delta_cmd_tag = step_delta_cmd.get_command_tag()
         self._reset_cmd_tag = self._mcu.lookup_command(
             "reset_step_clock oid=%c clock=%u").get_command_tag()
         self._get_position_cmd = self._mcu.lookup_query_command(
@@ -102,7 +107,8 @@ class MCU_stepper:
         max_error_ticks = self._mcu.seconds_to_clock(max_error)
         ffi_main, ffi_lib = chelper.get_ffi()
         ffi_lib.stepcompress_fill(self._stepqueue, max_error_ticks,
-                                  step_cmd_tag, dir_cmd_tag)
+                                  step_cmd_tag, dir_cmd_tag,
+                                  step_delta_cmd_tag)
     def get_oid(self):
         return self._oid
     def get_step_dist(self):
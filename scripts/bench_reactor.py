@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+# Benchmark the overhead of the host reactor timer dispatch code
+#
+# Copyright (C) 2026  agent <agent@local>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, random, time
+sys.path.append(os.path.join(os.path.dirname(__file__), '../klippy'))
+import reactor
+
+# Each timer reschedules itself with a fixed period (similar to the
+# periodic timers of heaters, fans, tmc checks, displays, and buttons)
+class PeriodicTimer:
+    def __init__(self, reactor, period, start):
+        self.period = period
+        self.count = 0
+        self.timer = reactor.register_timer(self.callback, start)
+    def callback(self, eventtime):
+        self.count += 1
+        return eventtime + self.period
+
+def run_bench(num_timers, duration, seed):
+    rng = random.Random(seed)
+    r = reactor.Reactor()
+    timers = [PeriodicTimer(r, rng.uniform(.005, 1.), rng.uniform(0., 1.))
+              for i in range(num_timers)]
+    # Simulate the dispatch loop of an otherwise idle reactor using a
+    # simulated clock
+    eventtime = 0.
+    wakeups = 0
+    start = time.perf_counter()
+    while eventtime < duration:
+        eventtime += r._check_timers(eventtime, False)
+        wakeups += 1
+    elapsed = time.perf_counter() - start
+    callbacks = sum([t.count for t in timers])
+    return elapsed, wakeups, callbacks
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-n", "--timers", type="int", dest="timers", default=200,
+                    help="number of active timers")
+    opts.add_option("-d", "--duration", type="float", dest="duration",
+                    default=60., help="simulated run time (in seconds)")
+    opts.add_option("-s", "--seed", type="int", dest="seed", default=0,
+                    help="random seed for timer periods")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+    elapsed, wakeups, callbacks = run_bench(options.timers, options.duration,
+                                            options.seed)
+    print("%d timers, %.0f simulated seconds: %d callbacks, %d wakeups"
+          % (options.timers, options.duration, callbacks, wakeups))
+    print("Total %.3fs (%.2fus per callback, %.2fus per wakeup)"
+          % (elapsed, elapsed * 1000000. / callbacks,
+             elapsed * 1000000. / wakeups))
+
+if __name__ == '__main__':
+    main()
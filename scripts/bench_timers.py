@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+# Benchmark micro-controller timer irq time versus number of timers
+#
+# Copyright (C) 2026  agent <agent@local>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, logging
+sys.path.append(os.path.join(os.path.dirname(__file__), '../klippy'))
+import reactor, serialhdl, clocksync
+
+# The micro-controller must be freshly started (not configured) and
+# must be built with the "Report timer and task latency histograms"
+# low-level option. Each trsync object is used as a periodic timer
+# (its report timer), which requires no hardware. All timers have the
+# same period and are evenly spread over that period, which is the
+# worst case for the sorted timer list (each rescheduled timer is
+# placed after all other timers). Periodically restarting each trsync
+# also exercises timer deletion (which runs with irqs disabled).
+class TimerBench:
+    def __init__(self, reactor, serialport, baud, options):
+        self.reactor = reactor
+        self.serialport = serialport
+        self.baud = baud
+        self.options = options
+        self.ser = serialhdl.SerialReader(reactor)
+        self.clocksync = clocksync.ClockSync(reactor)
+        self.names = []
+        self.counts = {}
+        self.collect = False
+        reactor.register_callback(self.run)
+    def handle_histogram(self, params):
+        hid = params['id']
+        if not self.collect or hid >= len(self.names):
+            return
+        data = bytearray(params['counts'])
+        counts = self.counts[self.names[hid]]
+        for i in range(len(counts)):
+            counts[i] += data[i*2] | (data[i*2+1] << 8)
+    def handle_shutdown(self, params):
+        self.output("MCU shutdown: %s" % (params['static_string_id'],))
+    def run(self, eventtime):
+        if self.baud:
+            self.ser.connect_uart(self.serialport, self.baud)
+        else:
+            self.ser.connect_pipe(self.serialport)
+        self.clocksync.connect(self.ser)
+        msgparser = self.ser.get_msgparser()
+        tasks = msgparser.get_constant('STATS_HISTOGRAM_TASKS', None)
+        if tasks is None:
+            self.output("MCU not built with histogram support")
+            self.reactor.end()
+            return
+        self.names = ['timer_lateness', 'timer_irq'] + tasks.split(',')
+        buckets = msgparser.get_constant_int('STATS_HISTOGRAM_BUCKETS')
+        shift = msgparser.get_constant_int('STATS_HISTOGRAM_SHIFT')
+        self.counts = {name: [0] * buckets for name in self.names}
+        self.ser.register_response(self.handle_histogram, 'stats_histogram')
+        self.ser.register_response(self.handle_shutdown, 'shutdown')
+        self.ser.handle_default = (lambda params: None)
+        freq = msgparser.get_constant_float('CLOCK_FREQ')
+        # Configure and start the timers
+        num_timers = self.options.timers
+        period = int(self.options.period * freq)
+        self.ser.send("allocate_oids count=%d" % (num_timers,))
+        for oid in range(num_timers):
+            self.ser.send("config_trsync oid=%d" % (oid,))
+        self.ser.send("finalize_config crc=0")
+        curtime = self.reactor.monotonic()
+        duration = self.options.duration
+        restart = self.options.restart
+        start_time = curtime + .5
+        while 1:
+            clock = self.clocksync.get_clock(curtime) + int(.100 * freq)
+            for oid in range(num_timers):
+                self.ser.send("trsync_start oid=%d report_clock=%d"
+                              " report_ticks=%d expire_reason=0"
+                              % (oid, clock + oid * period // num_timers,
+                                 period))
+            if curtime > start_time + duration:
+                break
+            curtime = self.reactor.pause(curtime + restart)
+            # Discard the reports from startup
+            self.collect = curtime > start_time
+        self.collect = False
+        # Report the upper bound of the highest non-empty bucket
+        self.output("%d timers (period %.3fms):" % (
+            num_timers, self.options.period * 1000.))
+        for name in ['timer_irq', 'timer_lateness']:
+            counts = self.counts[name]
+            total = sum(counts)
+            high = max([i for i, c in enumerate(counts) if c] or [0])
+            if high == buckets - 1:
+                bound = "overflow"
+            else:
+                bound = "%.3fus" % ((1 << (shift + high)) * 1000000. / freq,)
+            self.output("  %s: %d samples, max < %s (%s)" % (
+                name, total, bound,
+                ",".join(["%d:%d" % (i, c) for i, c in enumerate(counts)
+                          if c])))
+        self.ser.disconnect()
+        self.reactor.end()
+    def output(self, msg):
+        sys.stdout.write("%s\n" % (msg,))
+        sys.stdout.flush()
+
+def main():
+    usage = "%prog [options] <serialdevice>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-b", "--baud", type="int", dest="baud", help="baud rate")
+    opts.add_option("-n", "--timers", type="int", dest="timers", default=32,
+                    help="number of active timers")
+    opts.add_option("-p", "--period", type="float", dest="period",
+                    default=.050, help="timer period (in seconds)")
+    opts.add_option("-r", "--restart", type="float", dest="restart",
+                    default=1., help="time between restarts of all timers")
+    opts.add_option("-d", "--duration", type="float", dest="duration",
+                    default=30., help="test duration (in seconds)")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    serialport = args[0]
+    baud = options.baud
+    if baud is None and not (serialport.startswith("/dev/rpmsg_")
+                             or serialport.startswith("/tmp/")):
+        baud = 250000
+    logging.basicConfig(level=logging.WARNING)
+    r = reactor.Reactor()
+    TimerBench(r, serialport, baud, options)
+    r.run()
+
+if __name__ == '__main__':
+    main()
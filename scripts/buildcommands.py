@@ -40,6 +40,16 @@ class HandleCallList:
         self.call_lists.setdefault(funcname, []).append(callname)
     def update_data_dictionary(self, data):
         pass
+    def generate_task_histograms(self, funcs):
+        # Track the run time of each task (see src/histogram.c)
+        buckets = HandlerConstants.constants['STATS_HISTOGRAM_BUCKETS']
+        HandlerConstants.decl_constant_str(
+            "_DECL_CONSTANT_STR STATS_HISTOGRAM_TASKS " + ','.join(funcs))
+        fmt = """
+uint16_t histogram_task_counts[%d][%d];
+const uint8_t histogram_task_count = %d;
+"""
+        return fmt % (len(funcs), buckets, len(funcs))
     def generate_code(self, options):
         code = []
         for funcname, funcs in self.call_lists.items():
@@ -49,6 +59,16 @@ class HandleCallList:
                 add_poll = '    irq_poll();\n'
                 func_code = [add_poll + fc for fc in func_code]
                 func_code.append(add_poll)
+                if 'STATS_HISTOGRAM_BUCKETS' in HandlerConstants.constants:
+                    code.append(self.generate_task_histograms(funcs))
+                    func_code = [
+                        fc + '\n    histogram_task_done(%d);' % (i,)
+                        for i, fc in enumerate(func_code[:-1])
+                    ] + func_code[-1:]
+                    func_code.insert(0, (
+                        '    extern void histogram_task_start(void);\n'
+                        '    extern void histogram_task_done(uint_fast8_t);\n'
+                        '    histogram_task_start();'))
             fmt = """
 void
 %s(void)
@@ -246,6 +266,8 @@ Handlers.append(Handle_arm_irq())
 # Wire protocol commands and responses
 ######################################################################
 
+HF_FAST_PARSE = 0x02 # See src/command.h
+
 # Dynamic command and response registration
 class HandleCommandGeneration:
     def __init__(self):
@@ -413,7 +435,38 @@ const struct command_parser command_index[] PROGMEM = {
 
 const uint8_t command_index_size PROGMEM = ARRAY_SIZE(command_index);
 """
-        return fmt % (externs, index)
+        return fmt % (externs, index) + self.generate_fast_parse_code(cmd_by_id)
+    def generate_fast_parse_code(self, cmd_by_id):
+        # Create dedicated parsers for commands declared with HF_FAST_PARSE
+        cases = []
+        for msgid, (funcname, flags, msgname) in sorted(cmd_by_id.items()):
+            if not [f for f in flags.split('|')
+                    if int(f, 0) & HF_FAST_PARSE]:
+                continue
+            msg = self.messages_by_name[msgname]
+            param_types = [t for name, t in msgproto.lookup_params(msg)]
+            if [t for t in param_types if not t.is_int]:
+                error("HF_FAST_PARSE command '%s' must only have integer"
+                      " parameters" % (msgname,))
+            code = ["    case %d: // %s\n" % (msgid, msg)]
+            for i in range(len(param_types)):
+                code.append("        if (p > maxend)\n"
+                            "            break;\n"
+                            "        args[%d] = command_parse_int(&p);\n"
+                            % (i,))
+            code.append("        return p;\n")
+            cases.append("".join(code))
+        fmt = """
+uint8_t *
+ctr_parse_fast(uint_fast8_t cmdid, uint8_t *p, uint8_t *maxend
+               , uint32_t *args)
+{
+    switch (cmdid) {
+%s    }
+    return NULL;
+}
+"""
+        return fmt % ("".join(cases),)
     def generate_param_code(self):
         sorted_param_types = sorted(
             [(i, a) for a, i in self.all_param_types.items()])
@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+# Convert a g-code file to the compact binary g-code format
+#
+# Copyright (C) 2026  agent <agent@local>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, re, time, decimal
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                             '..', 'klippy'))
+import chelper, gcode
+
+# The binary format starts with a BINARY_GCODE_START line followed by
+# a series of records:
+#   0x00                        - end of binary data (text follows)
+#   0x01 <varint len> <text>    - a regular line of g-code
+#   0x80 | flags <params...>    - a G0/G1 move
+# Move flags are GP_X..GP_F (bits 0-4) and GP_G0 (bit 5).  Each
+# flagged parameter is a varint of (zigzag(mantissa) << 3) | places
+# and the value is mantissa / 10**places.
+
+MAX_PLACES = 7
+MAX_MANTISSA = 1 << 53
+
+def encode_varint(v):
+    out = bytearray()
+    while v >= 0x80:
+        out.append((v & 0x7f) | 0x80)
+        v >>= 7
+    out.append(v)
+    return bytes(out)
+
+def encode_text(line):
+    data = line.encode()
+    return (bytes(bytearray([gcode.BG_OP_TEXT])) + encode_varint(len(data))
+            + data)
+
+# Encode a decimal parameter value - returns None if it can't be
+# represented exactly
+def encode_value(text):
+    try:
+        sign, digits, exp = decimal.Decimal(text).as_tuple()
+    except decimal.InvalidOperation:
+        return None
+    if type(exp) is not int:
+        return None
+    mantissa = int("".join(map(str, digits)))
+    places = -exp
+    if places < 0:
+        mantissa *= 10**exp
+        places = 0
+    if (places > MAX_PLACES or mantissa >= MAX_MANTISSA
+        or (sign and not mantissa)):
+        return None
+    if sign:
+        mantissa = -mantissa
+    if float(text) != float(mantissa) / 10.**places:
+        return None
+    zigzag = mantissa * 2 if mantissa >= 0 else -mantissa * 2 - 1
+    return encode_varint((zigzag << 3) | places)
+
+value_r = re.compile(r'([XYZEFxyzef])([-+.0-9]+)')
+
+class Converter:
+    def __init__(self):
+        self.ffi_main, self.ffi_lib = chelper.get_ffi()
+        self.moves = self.ffi_main.new('struct gcode_move[1]')
+    def encode_move(self, line):
+        # Use the host's move parser to determine if line is a plain move
+        data = (line + "\n").encode()
+        if not self.ffi_lib.gcodeparse_moves(data, len(data), self.moves, 1):
+            return None
+        flags = self.moves[0].flags
+        values = {}
+        cpos = line.find(';')
+        if cpos >= 0:
+            line = line[:cpos]
+        for axis, text in value_r.findall(line):
+            ev = encode_value(text)
+            if ev is None:
+                return None
+            values["XYZEF".index(axis.upper())] = ev
+        out = [bytes(bytearray([gcode.BG_OP_MOVE | flags]))]
+        out.extend([values[i] for i in sorted(values)])
+        return b"".join(out)
+    def convert(self, infile, outfile):
+        outfile.write(gcode.BINARY_GCODE_START + b"\n")
+        for line in infile:
+            line = line.rstrip('\r\n')
+            if not line.strip():
+                continue
+            rec = self.encode_move(line)
+            if rec is None:
+                if len(line.encode()) > gcode.BG_MAX_TEXT_SIZE:
+                    raise ValueError("Line too long for binary g-code: %s..."
+                                     % (line[:40],))
+                rec = encode_text(line)
+            outfile.write(rec)
+        outfile.write(bytes(bytearray([gcode.BG_OP_END])))
+
+
+######################################################################
+# Parser benchmark
+######################################################################
+
+def bench_python(text):
+    args_r = gcode.GCodeDispatch.args_r
+    count = 0
+    for line in text.split('\n'):
+        line = line.strip()
+        cpos = line.find(';')
+        if cpos >= 0:
+            line = line[:cpos]
+        parts = args_r.split(line.upper())
+        params = { parts[i]: parts[i+1].strip()
+                   for i in range(1, len(parts), 2) }
+        if len(parts) >= 3 and parts[1] == 'G' and parts[2] in ('0', '1'):
+            for key in 'XYZEF':
+                if key in params:
+                    float(params[key])
+        count += 1
+    return count
+
+def bench_text(ffi_main, ffi_lib, data):
+    moves = ffi_main.new('struct gcode_move[64]')
+    ptr = ffi_main.from_buffer(data)
+    pos = count = 0
+    while pos < len(data):
+        num = ffi_lib.gcodeparse_moves(ptr + pos, len(data) - pos, moves, 64)
+        for i in range(num):
+            pos += moves[i].length
+        if not num:
+            pos = data.find(b'\n', pos) + 1
+            if not pos:
+                break
+            num = 1
+        count += num
+    return count
+
+def bench_binary(ffi_main, ffi_lib, data):
+    moves = ffi_main.new('struct gcode_move[64]')
+    ptr = ffi_main.from_buffer(data)
+    pos = len(gcode.BINARY_GCODE_START) + 1
+    count = 0
+    while pos < len(data):
+        num = ffi_lib.gcodeparse_binary_moves(ptr + pos, len(data) - pos,
+                                              moves, 64)
+        for i in range(num):
+            pos += moves[i].length
+        if not num:
+            op, text, pos = gcode.parse_binary_record(data, pos)
+            if op != gcode.BG_OP_TEXT:
+                break
+            num = 1
+        count += num
+    return count
+
+def benchmark(infilename, outfilename):
+    ffi_main, ffi_lib = chelper.get_ffi()
+    with open(infilename, 'rb') as f:
+        data = f.read()
+    with open(outfilename, 'rb') as f:
+        bdata = f.read()
+    text = data.decode()
+    tests = [("python", lambda: bench_python(text)),
+             ("c text", lambda: bench_text(ffi_main, ffi_lib, data)),
+             ("c binary", lambda: bench_binary(ffi_main, ffi_lib, bdata))]
+    sys.stdout.write("Text size %d, binary size %d (%.1f%%)\n"
+                     % (len(data), len(bdata), 100. * len(bdata) / len(data)))
+    for name, func in tests:
+        start = time.time()
+        count = func()
+        elapsed = time.time() - start
+        sys.stdout.write("%-10s %9d lines %8.3fs %12.0f lines/s\n"
+                         % (name, count, elapsed, count / elapsed))
+
+def main():
+    usage = "%prog [options] <input.gcode> <output.kgc>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-b", "--benchmark", action="store_true",
+                    help="compare parsing speed of the text and binary files")
+    options, args = opts.parse_args()
+    if len(args) != 2:
+        opts.error("Incorrect number of arguments")
+    infilename, outfilename = args
+    with open(infilename, 'r') as infile:
+        with open(outfilename, 'wb') as outfile:
+            Converter().convert(infile, outfile)
+    if options.benchmark:
+        benchmark(infilename, outfilename)
+
+if __name__ == '__main__':
+    main()
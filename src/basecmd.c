@@ -5,11 +5,16 @@
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <string.h> // memset
+#include "autoconf.h" // CONFIG_STEPPER_TIMERS
 #include "basecmd.h" // oid_lookup
+#include "board/gpioirq.h" // gpio_irq_reset
 #include "board/irq.h" // irq_save
 #include "board/misc.h" // alloc_maxsize
 #include "board/pgm.h" // READP
+#include "board/stepdma.h" // stepdma_reset
+#include "board/timer_irq.h" // timer_channel_reset
 #include "command.h" // DECL_COMMAND
+#include "histogram.h" // histogram_report
 #include "sched.h" // sched_clear_shutdown
 
 
@@ -60,9 +65,23 @@ alloc_chunks(size_t size, size_t count, uint16_t *avail)
 
 static struct move_node *move_free_list;
 static void *move_list;
-static uint16_t move_count;
+static uint16_t move_count, move_free_count, move_free_min;
 static uint8_t move_item_size;
 
+#define MOVE_NODE_END 0xffff
+
+// Convert between a move queue item and its offset in move_list
+static struct move_node *
+move_node_ptr(uint16_t pos)
+{
+    return pos == MOVE_NODE_END ? NULL : move_list + pos;
+}
+static uint16_t
+move_node_pos(struct move_node *m)
+{
+    return m ? (void*)m - move_list : MOVE_NODE_END;
+}
+
 // Is the config and move queue finalized?
 static int
 is_finalized(void)
@@ -76,8 +95,9 @@ void
 move_free(void *m)
 {
     struct move_node *mf = m;
-    mf->next = move_free_list;
+    mf->next = move_node_pos(move_free_list);
     move_free_list = mf;
+    move_free_count++;
 }
 
 // Allocate runtime storage
@@ -88,7 +108,9 @@ move_alloc(void)
     struct move_node *mf = move_free_list;
     if (!mf)
         shutdown("Move queue overflow");
-    move_free_list = mf->next;
+    move_free_list = move_node_ptr(mf->next);
+    if (--move_free_count < move_free_min)
+        move_free_min = move_free_count;
     irq_restore(flag);
     return mf;
 }
@@ -111,9 +133,9 @@ move_queue_first(struct move_queue_head *mh)
 int
 move_queue_push(struct move_node *m, struct move_queue_head *mh)
 {
-    m->next = NULL;
+    m->next = MOVE_NODE_END;
     if (mh->first) {
-        mh->last->next = m;
+        mh->last->next = move_node_pos(m);
         mh->last = m;
         return 0;
     }
@@ -126,7 +148,7 @@ struct move_node *
 move_queue_pop(struct move_queue_head *mh)
 {
     struct move_node *mn = mh->first;
-    mh->first = mn->next;
+    mh->first = move_node_ptr(mn->next);
     return mn;
 }
 
@@ -158,11 +180,12 @@ move_reset(void)
     uint32_t i;
     for (i=0; i<move_count-1; i++) {
         struct move_node *mf = move_list + i*move_item_size;
-        mf->next = move_list + (i + 1)*move_item_size;
+        mf->next = (i + 1)*move_item_size;
     }
     struct move_node *mf = move_list + (move_count - 1)*move_item_size;
-    mf->next = NULL;
+    mf->next = MOVE_NODE_END;
     move_free_list = move_list;
+    move_free_count = move_free_min = move_count;
 }
 DECL_SHUTDOWN(move_reset);
 
@@ -173,7 +196,10 @@ move_finalize(void)
         shutdown("Already finalized");
     struct move_queue_head dummy;
     move_queue_setup(&dummy, sizeof(*move_free_list));
-    move_list = alloc_chunks(move_item_size, 1024, &move_count);
+    // All item offsets must be representable in move_node->next
+    uint16_t max_count = MOVE_NODE_END / move_item_size;
+    move_list = alloc_chunks(move_item_size, max_count < 1024 ? max_count
+                             : 1024, &move_count);
     move_reset();
 }
 
@@ -271,6 +297,12 @@ config_reset(uint32_t *args)
     move_list = NULL;
     move_count = move_item_size = 0;
     alloc_init();
+    if (CONFIG_STEPPER_TIMERS)
+        timer_channel_reset();
+    if (CONFIG_STEPPER_DMA)
+        stepdma_reset();
+    if (CONFIG_ENDSTOP_IRQ)
+        gpio_irq_reset();
     sched_timer_reset();
     sched_clear_shutdown();
     irq_enable();
@@ -324,7 +356,15 @@ stats_update(uint32_t start, uint32_t cur)
 
     if (timer_is_before(cur, stats_send_time + timer_from_us(5000000)))
         return;
-    sendf("stats count=%u sum=%u sumsq=%u", count, sum, sumsq);
+    // Report the lowest number of free move queue items since last report
+    irq_disable();
+    uint16_t move_min_free = move_free_min;
+    move_free_min = move_free_count;
+    irq_enable();
+    sendf("stats count=%u sum=%u sumsq=%u move_min_free=%hu"
+          , count, sum, sumsq, move_min_free);
+    if (CONFIG_STATS_HISTOGRAMS)
+        histogram_report();
     if (cur < stats_send_time)
         stats_send_time_high++;
     stats_send_time = cur;
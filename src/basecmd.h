@@ -4,8 +4,10 @@
 #include <stddef.h> // size_t
 #include <stdint.h> // uint8_t
 
+// Move queue items are linked by their offset within the move storage
+// (items must not be PACKED - 32bit fields must be naturally aligned)
 struct move_node {
-    struct move_node *next;
+    uint16_t next;
 };
 struct move_queue_head {
     struct move_node *first, *last;
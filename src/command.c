@@ -6,6 +6,7 @@
 
 #include <stdarg.h> // va_start
 #include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_RECEIVE_BLOCK_MAX
 #include "board/io.h" // readb
 #include "board/irq.h" // irq_poll
 #include "board/misc.h" // crc16_ccitt
@@ -13,7 +14,9 @@
 #include "command.h" // output_P
 #include "sched.h" // sched_is_shutdown
 
-static uint8_t next_sequence = MESSAGE_DEST;
+static uint8_t next_sequence, sequence_flags;
+
+enum { SF_EXT=1<<0, SF_LEGACY_REPLY=1<<1 };
 
 static uint32_t
 command_encode_ptr(void *p)
@@ -23,11 +26,14 @@ command_encode_ptr(void *p)
     return (size_t)p;
 }
 
+// Buffer params may point into console_receive_buffer() or into the
+// reorder_blocks storage below.  Both are static data within the
+// same image, so a signed 32bit offset is sufficient on 64bit hosts.
 void *
 command_decode_ptr(uint32_t v)
 {
     if (sizeof(size_t) > sizeof(uint32_t))
-        return console_receive_buffer() + v;
+        return console_receive_buffer() + (int32_t)v;
     return (void*)(size_t)v;
 }
 
@@ -53,22 +59,6 @@ f4: *p++ = v & 0x7f;
     return p;
 }
 
-// Parse an integer that was encoded as a "variable length quantity"
-static uint32_t
-parse_int(uint8_t **pp)
-{
-    uint8_t *p = *pp, c = *p++;
-    uint32_t v = c & 0x7f;
-    if ((c & 0x60) == 0x60)
-        v |= -0x20;
-    while (c & 0x80) {
-        c = *p++;
-        v = (v<<7) | (c & 0x7f);
-    }
-    *pp = p;
-    return v;
-}
-
 // Parse an incoming command into 'args'
 uint8_t *
 command_parsef(uint8_t *p, uint8_t *maxend
@@ -87,7 +77,7 @@ command_parsef(uint8_t *p, uint8_t *maxend
         case PT_uint16:
         case PT_int16:
         case PT_byte:
-            *args++ = parse_int(&p);
+            *args++ = command_parse_int(&p);
             break;
         case PT_buffer: {
             uint_fast8_t len = *p++;
@@ -171,12 +161,30 @@ error:
     shutdown("Message encode error");
 }
 
+// Encode a sequence number into a message block sequence byte
+static uint_fast8_t
+encode_seq(uint_fast8_t seq, uint_fast8_t ext)
+{
+    uint_fast8_t msgseq = MESSAGE_DEST | (seq & MESSAGE_SEQ_MASK);
+    if (ext)
+        msgseq |= MESSAGE_SEQ_EXT | ((seq << 1) & MESSAGE_SEQ_EXT_MASK);
+    return msgseq;
+}
+
+// Decode the sequence number from a message block sequence byte
+static uint_fast8_t
+decode_seq(uint_fast8_t msgseq)
+{
+    return (msgseq & MESSAGE_SEQ_MASK) | ((msgseq & MESSAGE_SEQ_EXT_MASK) >> 1);
+}
+
 // Add header and trailer bytes to a message block
 static void
 command_add_frame(uint8_t *buf, uint_fast8_t msglen)
 {
+    uint_fast8_t ext = (sequence_flags & (SF_EXT|SF_LEGACY_REPLY)) == SF_EXT;
     buf[MESSAGE_POS_LEN] = msglen;
-    buf[MESSAGE_POS_SEQ] = next_sequence;
+    buf[MESSAGE_POS_SEQ] = encode_seq(next_sequence, ext);
     uint16_t crc = crc16_ccitt(buf, msglen - MESSAGE_TRAILER_SIZE);
     buf[msglen - MESSAGE_TRAILER_CRC + 0] = crc >> 8;
     buf[msglen - MESSAGE_TRAILER_CRC + 1] = crc;
@@ -239,11 +247,95 @@ const struct command_encoder encode_acknak PROGMEM = {
     .max_size = MESSAGE_MIN,
 };
 
+DECL_CONSTANT("RECEIVE_BLOCK_MAX", CONFIG_RECEIVE_BLOCK_MAX);
+DECL_CONSTANT("RECEIVE_SEQ_BITS", 6);
+
+// Storage for message blocks received ahead of a lost block
+struct reorder_block {
+    uint8_t seq, len;
+    uint8_t buf[CONFIG_RECEIVE_BLOCK_MAX];
+};
+
+#if CONFIG_RECEIVE_REORDER_BLOCKS
+DECL_CONSTANT("RECEIVE_REORDER_BLOCKS", CONFIG_RECEIVE_REORDER_BLOCKS);
+
+static struct reorder_block reorder_blocks[CONFIG_RECEIVE_REORDER_BLOCKS];
+
+// Return the distance of a sequence number past the next expected one
+static uint_fast8_t
+reorder_distance(uint_fast8_t seq)
+{
+    return (seq - next_sequence) & (MESSAGE_SEQ_EXT_COUNT - 1);
+}
+
+// Store a message block that arrived ahead of the next expected block
+static void
+reorder_store(uint8_t *buf, uint_fast8_t msglen, uint_fast8_t seq)
+{
+    if (reorder_distance(seq) >= MESSAGE_SEQ_EXT_COUNT / 2)
+        // Old retransmitted block
+        return;
+    struct reorder_block *rb, *free_rb = NULL;
+    for (rb = reorder_blocks; rb < &reorder_blocks[ARRAY_SIZE(reorder_blocks)]
+             ; rb++) {
+        if (!rb->len)
+            free_rb = rb;
+        else if (rb->seq == seq)
+            return;
+    }
+    if (!free_rb)
+        return;
+    free_rb->seq = seq;
+    free_rb->len = msglen;
+    memcpy(free_rb->buf, buf, msglen);
+}
+
+// Discard stored blocks that are no longer ahead of the next sequence
+static void
+reorder_purge(void)
+{
+    struct reorder_block *rb;
+    for (rb = reorder_blocks; rb < &reorder_blocks[ARRAY_SIZE(reorder_blocks)]
+             ; rb++)
+        if (rb->len && (!(sequence_flags & SF_EXT)
+                        || reorder_distance(rb->seq)
+                           >= MESSAGE_SEQ_EXT_COUNT / 2))
+            rb->len = 0;
+}
+
+// Find a stored block for the next expected sequence number
+static struct reorder_block *
+reorder_find_next(void)
+{
+    struct reorder_block *rb;
+    for (rb = reorder_blocks; rb < &reorder_blocks[ARRAY_SIZE(reorder_blocks)]
+             ; rb++)
+        if (rb->len && rb->seq == next_sequence)
+            return rb;
+    return NULL;
+}
+#else
+static inline void
+reorder_store(uint8_t *buf, uint_fast8_t msglen, uint_fast8_t seq)
+{
+}
+static inline void
+reorder_purge(void)
+{
+}
+static inline struct reorder_block *
+reorder_find_next(void)
+{
+    return NULL;
+}
+#endif
+
 enum { CF_NEED_SYNC=1<<0, CF_NEED_VALID=1<<1 };
 
 // Find the next complete message block
-int_fast8_t
-command_find_block(uint8_t *buf, uint_fast8_t buf_len, uint_fast8_t *pop_count)
+static int_fast8_t
+find_block(uint8_t *buf, uint_fast8_t buf_len, uint_fast8_t *pop_count
+           , uint_fast8_t can_reorder)
 {
     static uint8_t sync_state;
     if (buf_len && sync_state & CF_NEED_SYNC)
@@ -251,10 +343,12 @@ command_find_block(uint8_t *buf, uint_fast8_t buf_len, uint_fast8_t *pop_count)
     if (buf_len < MESSAGE_MIN)
         goto need_more_data;
     uint_fast8_t msglen = buf[MESSAGE_POS_LEN];
-    if (msglen < MESSAGE_MIN || msglen > MESSAGE_MAX)
+    if (msglen < MESSAGE_MIN || msglen > CONFIG_RECEIVE_BLOCK_MAX)
         goto error;
     uint_fast8_t msgseq = buf[MESSAGE_POS_SEQ];
-    if ((msgseq & ~MESSAGE_SEQ_MASK) != MESSAGE_DEST)
+    uint_fast8_t is_ext = msgseq & MESSAGE_SEQ_EXT;
+    if ((msgseq & ~(MESSAGE_SEQ_MASK | MESSAGE_SEQ_EXT | MESSAGE_SEQ_EXT_MASK))
+        != MESSAGE_DEST || (!is_ext && msgseq & MESSAGE_SEQ_EXT_MASK))
         goto error;
     if (buf_len < msglen)
         goto need_more_data;
@@ -267,12 +361,30 @@ command_find_block(uint8_t *buf, uint_fast8_t buf_len, uint_fast8_t *pop_count)
         goto error;
     sync_state &= ~CF_NEED_VALID;
     *pop_count = msglen;
-    // Check sequence number
-    if (msgseq != next_sequence) {
+    // Check sequence number.  Hosts using extended (6 bit) sequence
+    // numbers switch over on a block that matches the low 4 bits.
+    uint_fast8_t seq = decode_seq(msgseq);
+    if ((seq ^ next_sequence) & MESSAGE_SEQ_MASK
+        || (is_ext && sequence_flags & SF_EXT && seq != next_sequence)) {
         // Lost message - discard messages until it is retransmitted
-        goto nak;
+        if (!(sequence_flags & SF_EXT))
+            goto nak;
+        if (is_ext) {
+            if (can_reorder && CONFIG_RECEIVE_REORDER_BLOCKS)
+                reorder_store(buf, msglen, seq);
+            goto nak;
+        }
+        // Reply to legacy blocks with a legacy sequence number
+        sequence_flags |= SF_LEGACY_REPLY;
+        command_sendf(&encode_acknak);
+        sequence_flags &= ~SF_LEGACY_REPLY;
+        return -1;
     }
-    next_sequence = ((msgseq + 1) & MESSAGE_SEQ_MASK) | MESSAGE_DEST;
+    next_sequence = ((is_ext ? seq : next_sequence) + 1) & (
+        MESSAGE_SEQ_EXT_COUNT - 1);
+    sequence_flags = is_ext ? SF_EXT : 0;
+    if (CONFIG_RECEIVE_REORDER_BLOCKS)
+        reorder_purge();
     return 1;
 
 need_more_data:
@@ -302,6 +414,13 @@ nak:
     return -1;
 }
 
+// Find the next complete message block
+int_fast8_t
+command_find_block(uint8_t *buf, uint_fast8_t buf_len, uint_fast8_t *pop_count)
+{
+    return find_block(buf, buf_len, pop_count, 0);
+}
+
 // Dispatch all the commands found in a message block
 void
 command_dispatch(uint8_t *buf, uint_fast8_t msglen)
@@ -312,8 +431,15 @@ command_dispatch(uint8_t *buf, uint_fast8_t msglen)
         uint_fast8_t cmdid = *p++;
         const struct command_parser *cp = command_lookup_parser(cmdid);
         uint32_t args[READP(cp->num_args)];
-        p = command_parsef(p, msgend, cp, args);
-        if (sched_is_shutdown() && !(READP(cp->flags) & HF_IN_SHUTDOWN)) {
+        uint_fast8_t flags = READP(cp->flags);
+        if (flags & HF_FAST_PARSE) {
+            p = ctr_parse_fast(cmdid, p, msgend, args);
+            if (!p)
+                shutdown("Command parser error");
+        } else {
+            p = command_parsef(p, msgend, cp, args);
+        }
+        if (sched_is_shutdown() && !(flags & HF_IN_SHUTDOWN)) {
             sched_report_shutdown();
             continue;
         }
@@ -335,9 +461,19 @@ int_fast8_t
 command_find_and_dispatch(uint8_t *buf, uint_fast8_t buf_len
                           , uint_fast8_t *pop_count)
 {
-    int_fast8_t ret = command_find_block(buf, buf_len, pop_count);
+    int_fast8_t ret = find_block(buf, buf_len, pop_count, 1);
     if (ret > 0) {
         command_dispatch(buf, *pop_count);
+        // Dispatch any stored blocks that are now in sequence
+        while (CONFIG_RECEIVE_REORDER_BLOCKS) {
+            struct reorder_block *rb = reorder_find_next();
+            if (!rb)
+                break;
+            uint_fast8_t msglen = rb->len;
+            rb->len = 0;
+            next_sequence = (next_sequence + 1) & (MESSAGE_SEQ_EXT_COUNT - 1);
+            command_dispatch(rb->buf, msglen);
+        }
         command_send_ack();
     }
     return ret;
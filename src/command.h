@@ -15,6 +15,7 @@
 
 // Flags for command handler declarations.
 #define HF_IN_SHUTDOWN   0x01   // Handler can run even when in emergency stop
+#define HF_FAST_PARSE    0x02   // Generate a dedicated parser for the command
 
 // Declare a constant exported to the host
 #define DECL_CONSTANT(NAME, VALUE)                              \
@@ -54,6 +55,9 @@
 #define MESSAGE_PAYLOAD_MAX (MESSAGE_MAX - MESSAGE_MIN)
 #define MESSAGE_SEQ_MASK 0x0f
 #define MESSAGE_DEST 0x10
+#define MESSAGE_SEQ_EXT 0x80
+#define MESSAGE_SEQ_EXT_MASK 0x60
+#define MESSAGE_SEQ_EXT_COUNT 64
 #define MESSAGE_SYNC 0x7E
 
 struct command_encoder {
@@ -70,6 +74,22 @@ enum {
     PT_string, PT_progmem_buffer, PT_buffer,
 };
 
+// Parse an integer that was encoded as a "variable length quantity"
+static inline uint32_t
+command_parse_int(uint8_t **pp)
+{
+    uint8_t *p = *pp, c = *p++;
+    uint32_t v = c & 0x7f;
+    if ((c & 0x60) == 0x60)
+        v |= -0x20;
+    while (c & 0x80) {
+        c = *p++;
+        v = (v<<7) | (c & 0x7f);
+    }
+    *pp = p;
+    return v;
+}
+
 // command.c
 void *command_decode_ptr(uint32_t v);
 uint8_t *command_parsef(uint8_t *p, uint8_t *maxend
@@ -92,6 +112,8 @@ extern const uint32_t command_identify_size;
 const struct command_encoder *ctr_lookup_encoder(const char *str);
 const struct command_encoder *ctr_lookup_output(const char *str);
 uint8_t ctr_lookup_static_string(const char *str);
+uint8_t *ctr_parse_fast(uint_fast8_t cmdid, uint8_t *p, uint8_t *maxend
+                        , uint32_t *args);
 
 #define _DECL_ENCODER(FMT) ({                   \
     DECL_CTR("_DECL_ENCODER " FMT);             \
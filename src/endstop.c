@@ -4,9 +4,12 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_ENDSTOP_IRQ
 #include "basecmd.h" // oid_alloc
 #include "board/gpio.h" // struct gpio
+#include "board/gpioirq.h" // gpio_irq_enable
 #include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_read_time
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // struct timer
 #include "trsync.h" // trsync_do_trigger
@@ -14,27 +17,87 @@
 struct endstop {
     struct timer time;
     struct gpio_in pin;
+#if CONFIG_ENDSTOP_IRQ
+    struct gpio_irq irq;
+#endif
     uint32_t rest_time, sample_time, nextwake;
     struct trsync *ts;
     uint8_t flags, sample_count, trigger_count, trigger_reason;
 };
 
-enum { ESF_PIN_HIGH=1<<0, ESF_HOMING=1<<1 };
+enum { ESF_PIN_HIGH=1<<0, ESF_HOMING=1<<1, ESF_IRQ=1<<2 };
 
 static uint_fast8_t endstop_oversample_event(struct timer *t);
 
+#if CONFIG_ENDSTOP_IRQ
+// Pin change irq callback for an end stop
+static void
+endstop_irq_event(struct gpio_irq *gi, uint32_t time)
+{
+    struct endstop *e = container_of(gi, struct endstop, irq);
+    irqstatus_t flag = irq_save();
+    if (!(e->flags & ESF_HOMING)) {
+        // Stale irq from a homing operation that has since ended
+        irq_restore(flag);
+        return;
+    }
+    // Report the edge time as the trigger time (the host calculates
+    // it from nextwake) and confirm it by oversampling the pin
+    e->nextwake = time + e->rest_time;
+    e->time.func = endstop_oversample_event;
+    e->time.waketime = timer_read_time() + e->sample_time;
+    sched_add_timer(&e->time);
+    irq_restore(flag);
+}
+
+// Try to use a pin change irq for an end stop
+static void
+endstop_irq_setup(struct endstop *e, uint32_t pin)
+{
+    if (gpio_irq_setup(&e->irq, pin) == 0) {
+        e->irq.func = endstop_irq_event;
+        e->flags = ESF_IRQ;
+    }
+}
+
+static void
+endstop_irq_enable(struct endstop *e)
+{
+    gpio_irq_enable(&e->irq, e->flags & ESF_PIN_HIGH);
+}
+
+static void
+endstop_irq_disable(struct endstop *e)
+{
+    gpio_irq_disable(&e->irq);
+}
+#else
+static void endstop_irq_setup(struct endstop *e, uint32_t pin) { }
+static void endstop_irq_enable(struct endstop *e) { }
+static void endstop_irq_disable(struct endstop *e) { }
+#endif
+
 // Timer callback for an end stop
 static uint_fast8_t
 endstop_event(struct timer *t)
 {
     struct endstop *e = container_of(t, struct endstop, time);
+    uint8_t flags = e->flags;
+    if (CONFIG_ENDSTOP_IRQ && flags & ESF_IRQ)
+        // Arm the pin change irq before checking the pin
+        endstop_irq_enable(e);
     uint8_t val = gpio_in_read(e->pin);
     uint32_t nextwake = e->time.waketime + e->rest_time;
-    if ((val ? ~e->flags : e->flags) & ESF_PIN_HIGH) {
+    if ((val ? ~flags : flags) & ESF_PIN_HIGH) {
+        if (CONFIG_ENDSTOP_IRQ && flags & ESF_IRQ)
+            // No match - wait for endstop_irq_event()
+            return SF_DONE;
         // No match - reschedule for the next attempt
         e->time.waketime = nextwake;
         return SF_RESCHEDULE;
     }
+    if (CONFIG_ENDSTOP_IRQ && flags & ESF_IRQ)
+        endstop_irq_disable(e);
     e->nextwake = nextwake;
     e->time.func = endstop_oversample_event;
     return endstop_oversample_event(t);
@@ -68,6 +131,8 @@ command_config_endstop(uint32_t *args)
 {
     struct endstop *e = oid_alloc(args[0], command_config_endstop, sizeof(*e));
     e->pin = gpio_in_setup(args[1], args[2]);
+    if (CONFIG_ENDSTOP_IRQ)
+        endstop_irq_setup(e, args[1]);
 }
 DECL_COMMAND(command_config_endstop, "config_endstop oid=%c pin=%c pull_up=%c");
 
@@ -76,6 +141,9 @@ void
 command_endstop_home(uint32_t *args)
 {
     struct endstop *e = oid_lookup(args[0], command_config_endstop);
+    uint8_t irq_flag = e->flags & ESF_IRQ;
+    if (CONFIG_ENDSTOP_IRQ && irq_flag)
+        endstop_irq_disable(e);
     sched_del_timer(&e->time);
     e->time.waketime = args[1];
     e->sample_time = args[2];
@@ -83,13 +151,13 @@ command_endstop_home(uint32_t *args)
     if (!e->sample_count) {
         // Disable end stop checking
         e->ts = NULL;
-        e->flags = 0;
+        e->flags = irq_flag;
         return;
     }
     e->rest_time = args[4];
     e->time.func = endstop_event;
     e->trigger_count = e->sample_count;
-    e->flags = ESF_HOMING | (args[5] ? ESF_PIN_HIGH : 0);
+    e->flags = irq_flag | ESF_HOMING | (args[5] ? ESF_PIN_HIGH : 0);
     e->ts = trsync_oid_lookup(args[6]);
     e->trigger_reason = args[7];
     sched_add_timer(&e->time);
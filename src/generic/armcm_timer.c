@@ -10,6 +10,7 @@
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_from_us
 #include "command.h" // shutdown
+#include "histogram.h" // histogram_timer_irq
 #include "sched.h" // sched_timer_dispatch
 
 DECL_CONSTANT("CLOCK_FREQ", CONFIG_CLOCK_FREQ);
@@ -123,15 +124,19 @@ static uint32_t
 timer_dispatch_many(void)
 {
     uint32_t tru = timer_repeat_until;
+    uint32_t start = CONFIG_STATS_HISTOGRAMS ? timer_read_time() : 0;
     for (;;) {
         // Run the next software timer
         uint32_t next = sched_timer_dispatch();
 
         uint32_t now = timer_read_time();
         int32_t diff = next - now;
-        if (diff > (int32_t)TIMER_MIN_TRY_TICKS)
+        if (diff > (int32_t)TIMER_MIN_TRY_TICKS) {
             // Schedule next timer normally.
+            if (CONFIG_STATS_HISTOGRAMS)
+                histogram_timer_irq(now - start);
             return diff;
+        }
 
         if (unlikely(timer_is_before(tru, now))) {
             // Check if there are too many repeat timers
@@ -139,6 +144,8 @@ timer_dispatch_many(void)
                 try_shutdown("Rescheduled timer in the past");
             if (sched_tasks_busy()) {
                 timer_repeat_until = now + TIMER_REPEAT_TICKS;
+                if (CONFIG_STATS_HISTOGRAMS)
+                    histogram_timer_irq(now - start);
                 return TIMER_DEFER_REPEAT_TICKS;
             }
             timer_repeat_until = tru = now + TIMER_IDLE_REPEAT_TICKS;
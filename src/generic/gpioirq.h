@@ -0,0 +1,16 @@
+#ifndef __GENERIC_GPIOIRQ_H
+#define __GENERIC_GPIOIRQ_H
+
+#include <stdint.h> // uint32_t
+
+struct gpio_irq {
+    void (*func)(struct gpio_irq *gi, uint32_t time);
+    uint8_t pin;
+};
+
+int gpio_irq_setup(struct gpio_irq *gi, uint32_t pin);
+void gpio_irq_enable(struct gpio_irq *gi, uint_fast8_t rising);
+void gpio_irq_disable(struct gpio_irq *gi);
+void gpio_irq_reset(void);
+
+#endif // gpioirq.h
@@ -0,0 +1,15 @@
+#ifndef __GENERIC_STEPDMA_H
+#define __GENERIC_STEPDMA_H
+
+#include <stdint.h> // uint32_t
+
+struct stepdma *stepdma_setup(uint32_t step_pin, uint32_t dir_pin
+                              , int32_t invert_step, uint32_t pulse_ticks);
+uint_fast8_t stepdma_push(struct stepdma *sd, uint32_t steptime
+                          , uint_fast8_t dir);
+uint_fast8_t stepdma_flush(struct stepdma *sd, uint32_t *pnext);
+int32_t stepdma_pending(struct stepdma *sd);
+int32_t stepdma_stop(struct stepdma *sd);
+void stepdma_reset(void);
+
+#endif // stepdma.h
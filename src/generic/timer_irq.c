@@ -9,7 +9,9 @@
 #include "board/misc.h" // timer_from_us
 #include "board/timer_irq.h" // timer_dispatch_many
 #include "command.h" // shutdown
+#include "histogram.h" // histogram_timer_irq
 #include "sched.h" // sched_timer_dispatch
+#include "stepper.h" // stepper_event
 
 DECL_CONSTANT("CLOCK_FREQ", CONFIG_CLOCK_FREQ);
 
@@ -41,15 +43,19 @@ uint32_t
 timer_dispatch_many(void)
 {
     uint32_t tru = timer_repeat_until;
+    uint32_t start = CONFIG_STATS_HISTOGRAMS ? timer_read_time() : 0;
     for (;;) {
         // Run the next software timer
         uint32_t next = sched_timer_dispatch();
 
         uint32_t now = timer_read_time();
         int32_t diff = next - now;
-        if (diff > (int32_t)TIMER_MIN_TRY_TICKS)
+        if (diff > (int32_t)TIMER_MIN_TRY_TICKS) {
             // Schedule next timer normally.
+            if (CONFIG_STATS_HISTOGRAMS)
+                histogram_timer_irq(now - start);
             return next;
+        }
 
         if (unlikely(timer_is_before(tru, now))) {
             // Check if there are too many repeat timers
@@ -57,6 +63,8 @@ timer_dispatch_many(void)
                 try_shutdown("Rescheduled timer in the past");
             if (sched_tasks_busy()) {
                 timer_repeat_until = now + TIMER_REPEAT_TICKS;
+                if (CONFIG_STATS_HISTOGRAMS)
+                    histogram_timer_irq(now - start);
                 return now + TIMER_DEFER_REPEAT_TICKS;
             }
             timer_repeat_until = tru = now + TIMER_IDLE_REPEAT_TICKS;
@@ -70,6 +78,65 @@ timer_dispatch_many(void)
     }
 }
 
+// Return the time to program into a dedicated hardware timer channel
+// for a newly added timer - called from board code.
+uint32_t
+timer_channel_start(struct timer *t)
+{
+    uint32_t waketime = t->waketime, now = timer_read_time();
+    if (timer_is_before(waketime, now))
+        try_shutdown("Timer too close");
+    if (timer_is_before(waketime, now + TIMER_MIN_TRY_TICKS))
+        return now + TIMER_MIN_TRY_TICKS;
+    return waketime;
+}
+
+// Invoke a timer that has a dedicated hardware timer channel - called
+// from board irq code.  Returns SF_RESCHEDULE (and stores the time to
+// program into the channel in 'pnext') or SF_DONE.
+uint_fast8_t
+timer_dispatch_channel(struct timer *t, uint32_t *pnext)
+{
+    uint32_t repeat_until = timer_read_time() + TIMER_REPEAT_TICKS;
+    for (;;) {
+        uint32_t waketime = t->waketime, now = timer_read_time();
+        int32_t diff = waketime - now;
+        if (diff > (int32_t)TIMER_MIN_TRY_TICKS) {
+            // Schedule next event normally.
+            *pnext = waketime;
+            return SF_RESCHEDULE;
+        }
+
+        if (unlikely(timer_is_before(repeat_until, now))) {
+            // Check if there are too many repeat events
+            if (diff < (int32_t)(-timer_from_us(1000))) {
+                try_shutdown("Rescheduled timer in the past");
+                return SF_DONE;
+            }
+            if (sched_tasks_busy()) {
+                *pnext = now + TIMER_DEFER_REPEAT_TICKS;
+                return SF_RESCHEDULE;
+            }
+            repeat_until = now + TIMER_IDLE_REPEAT_TICKS;
+        }
+
+        // Event in the past or near future - wait for it to be ready
+        irq_enable();
+        while (unlikely(diff > 0))
+            diff = waketime - timer_read_time();
+        irq_disable();
+
+        // Invoke timer callback
+        uint_fast8_t res;
+        if (CONFIG_INLINE_STEPPER_HACK && likely(!t->func))
+            res = stepper_event(t);
+        else
+            res = t->func(t);
+        if (res == SF_DONE)
+            return SF_DONE;
+    }
+}
+
 // Make sure timer_repeat_until doesn't wrap 32bit comparisons
 void
 timer_task(void)
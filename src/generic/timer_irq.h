@@ -1,6 +1,17 @@
 #ifndef __GENERIC_TIMER_IRQ_H
 #define __GENERIC_TIMER_IRQ_H
 
+#include <stdint.h> // uint32_t
+
+struct timer;
 uint32_t timer_dispatch_many(void);
+uint32_t timer_channel_start(struct timer *t);
+uint_fast8_t timer_dispatch_channel(struct timer *t, uint32_t *pnext);
+
+// Dedicated hardware timer channels (implemented in board code)
+int8_t timer_channel_alloc(struct timer *t);
+void timer_channel_add(uint8_t chan);
+void timer_channel_del(uint8_t chan);
+void timer_channel_reset(void);
 
 #endif // timer_irq.h
@@ -86,7 +86,8 @@ console_sendf(const struct command_encoder *ce, va_list args)
  ****************************************************************/
 
 static struct task_wake usb_bulk_out_wake;
-static uint8_t receive_buf[128], receive_pos;
+static uint8_t receive_buf[CONFIG_RECEIVE_BLOCK_MAX + USB_CDC_EP_BULK_OUT_SIZE];
+static uint8_t receive_pos;
 
 void
 usb_notify_bulk_out(void)
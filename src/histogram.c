@@ -0,0 +1,109 @@
+// Histograms of timer lateness and task run time
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "autoconf.h" // CONFIG_CLOCK_FREQ
+#include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_read_time
+#include "command.h" // DECL_CONSTANT
+#include "histogram.h" // histogram_report
+#include "sched.h" // DECL_TASK
+
+// Bucket 0 holds samples shorter than 1<<HISTOGRAM_SHIFT ticks (about
+// 1us) and each following bucket holds samples up to twice as long.
+#define HISTOGRAM_BUCKETS 16
+#define HISTOGRAM_SHIFT (31 - __builtin_clz(CONFIG_CLOCK_FREQ / 1000000))
+DECL_CONSTANT("STATS_HISTOGRAM_BUCKETS", HISTOGRAM_BUCKETS);
+DECL_CONSTANT("STATS_HISTOGRAM_SHIFT", HISTOGRAM_SHIFT);
+
+static uint16_t timer_lateness[HISTOGRAM_BUCKETS];
+static uint16_t timer_irq[HISTOGRAM_BUCKETS];
+
+// Storage for each DECL_TASK function (generated by buildcommands.py)
+extern uint16_t histogram_task_counts[][HISTOGRAM_BUCKETS];
+extern const uint8_t histogram_task_count;
+
+// Add a sample to a histogram
+static void
+histogram_add(uint16_t *counts, uint32_t ticks)
+{
+    ticks >>= HISTOGRAM_SHIFT;
+    uint_fast8_t bucket = ticks ? 32 - __builtin_clz(ticks) : 0;
+    if (bucket >= HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS - 1;
+    uint16_t count = counts[bucket] + 1;
+    if (count)
+        counts[bucket] = count;
+}
+
+// Note the start of a timer callback - called from sched.c
+void
+histogram_timer_dispatch(uint32_t waketime)
+{
+    int32_t late = timer_read_time() - waketime;
+    histogram_add(timer_lateness, late > 0 ? late : 0);
+}
+
+// Note the run time of a timer irq - called from board timer code
+void
+histogram_timer_irq(uint32_t ticks)
+{
+    histogram_add(timer_irq, ticks);
+}
+
+static uint32_t histogram_task_time;
+
+// Note the start of the task list - called from generated code
+void
+histogram_task_start(void)
+{
+    histogram_task_time = timer_read_time();
+}
+
+// Note the completion of a task - called from generated code
+void
+histogram_task_done(uint_fast8_t task)
+{
+    uint32_t cur = timer_read_time();
+    histogram_add(histogram_task_counts[task], cur - histogram_task_time);
+    histogram_task_time = cur;
+}
+
+static struct task_wake histogram_wake;
+static uint8_t histogram_report_id;
+
+// Start reporting all histograms - called from basecmd.c
+void
+histogram_report(void)
+{
+    histogram_report_id = 0;
+    sched_wake_task(&histogram_wake);
+}
+
+// Report (and then clear) one histogram
+void
+histogram_task(void)
+{
+    if (!sched_check_wake(&histogram_wake))
+        return;
+    uint8_t id = histogram_report_id, count = histogram_task_count + 2;
+    if (id >= count)
+        return;
+    uint16_t *counts = (id == 0 ? timer_lateness : id == 1 ? timer_irq
+                        : histogram_task_counts[id - 2]);
+    uint8_t data[HISTOGRAM_BUCKETS * 2], i;
+    irq_disable();
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        data[i*2] = counts[i];
+        data[i*2 + 1] = counts[i] >> 8;
+        counts[i] = 0;
+    }
+    irq_enable();
+    sendf("stats_histogram id=%c counts=%*s", id, sizeof(data), data);
+    histogram_report_id = id + 1;
+    if (id + 1 < count)
+        sched_wake_task(&histogram_wake);
+}
+DECL_TASK(histogram_task);
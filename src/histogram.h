@@ -0,0 +1,10 @@
+#ifndef __HISTOGRAM_H
+#define __HISTOGRAM_H
+
+#include <stdint.h> // uint32_t
+
+void histogram_timer_dispatch(uint32_t waketime);
+void histogram_timer_irq(uint32_t ticks);
+void histogram_report(void);
+
+#endif // histogram.h
@@ -14,6 +14,7 @@
 #include <sys/stat.h> // chmod
 #include <time.h> // struct timespec
 #include <unistd.h> // ttyname
+#include "autoconf.h" // CONFIG_RECEIVE_BLOCK_MAX
 #include "board/irq.h" // irq_wait
 #include "board/misc.h" // console_sendf
 #include "command.h" // command_find_block
@@ -151,7 +152,8 @@ console_task(void)
 
     // Find and dispatch message blocks in the input
     int len = receive_pos + ret;
-    uint_fast8_t pop_count, msglen = len > MESSAGE_MAX ? MESSAGE_MAX : len;
+    uint_fast8_t pop_count, msglen = (len > CONFIG_RECEIVE_BLOCK_MAX
+                                      ? CONFIG_RECEIVE_BLOCK_MAX : len);
     ret = command_find_and_dispatch(receive_buf, msglen, &pop_count);
     if (ret) {
         len -= pop_count;
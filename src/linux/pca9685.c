@@ -140,8 +140,8 @@ struct i2cpwm_s {
 
 struct pca9685_move {
     struct move_node node;
-    uint32_t waketime;
     uint16_t value;
+    uint32_t waketime;
 };
 
 DECL_CONSTANT("PCA9685_MAX", VALUE_MAX);
@@ -10,6 +10,7 @@
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_from_us
 #include "command.h" // DECL_CONSTANT
+#include "histogram.h" // histogram_timer_irq
 #include "internal.h" // console_sleep
 #include "sched.h" // DECL_INIT
 
@@ -131,7 +132,8 @@ timer_kick(void)
 static void
 timer_dispatch(void)
 {
-    uint32_t repeat_count = TIMER_REPEAT_COUNT, next;
+    uint32_t repeat_count = TIMER_REPEAT_COUNT, next, now;
+    uint32_t start = CONFIG_STATS_HISTOGRAMS ? timer_read_time() : 0;
     for (;;) {
         // Run the next software timer
         next = sched_timer_dispatch();
@@ -142,7 +144,7 @@ timer_dispatch(void)
             // Can run next timer without overhead of calling timer_read_time()
             continue;
 
-        uint32_t now = timer_read_time();
+        now = timer_read_time();
         int32_t diff = next - now;
         if (diff > (int32_t)TIMER_MIN_TRY_TICKS)
             // Schedule next timer normally.
@@ -152,8 +154,11 @@ timer_dispatch(void)
             // Check if there are too many repeat timers
             if (diff < (int32_t)(-timer_from_us(100000)))
                 try_shutdown("Rescheduled timer in the past");
-            if (sched_tasks_busy())
+            if (sched_tasks_busy()) {
+                if (CONFIG_STATS_HISTOGRAMS)
+                    histogram_timer_irq(now - start);
                 return;
+            }
             repeat_count = TIMER_IDLE_REPEAT_COUNT;
         }
 
@@ -162,6 +167,9 @@ timer_dispatch(void)
             diff = next - timer_read_time();
     }
 
+    if (CONFIG_STATS_HISTOGRAMS)
+        histogram_timer_irq(now - start);
+
     // Schedule SIGALRM signal
     struct itimerspec it;
     it.it_interval = (struct timespec){0, 0};
@@ -21,8 +21,8 @@ struct pwm_out_s {
 
 struct pwm_move {
     struct move_node node;
-    uint32_t waketime;
     uint16_t value;
+    uint32_t waketime;
 };
 
 static uint_fast8_t
@@ -4,6 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_ADC_DMA
 #include "board/misc.h" // timer_from_us
 #include "command.h" // shutdown
 #include "gpio.h" // gpio_adc_setup
@@ -38,6 +39,8 @@ gpio_adc_setup(uint32_t pin)
         chan = pin - 26;
         padsbank0_hw->io[pin] = PADS_BANK0_GPIO0_OD_BITS;
     }
+    if (CONFIG_ADC_DMA)
+        adc_scan_add(chan);
 
     return (struct gpio_adc){ .chan = chan };
 }
@@ -51,6 +54,8 @@ static uint8_t last_analog_read = ADC_DUMMY;
 uint32_t
 gpio_adc_sample(struct gpio_adc g)
 {
+    if (CONFIG_ADC_DMA)
+        return adc_scan_sample(g.chan);
     uint32_t cs = adc_hw->cs;
     if (!(cs & ADC_CS_READY_BITS))
         // ADC is busy
@@ -75,6 +80,8 @@ need_delay:
 uint16_t
 gpio_adc_read(struct gpio_adc g)
 {
+    if (CONFIG_ADC_DMA)
+        return adc_scan_read(g.chan);
     last_analog_read = ADC_DUMMY;
     return adc_hw->result;
 }
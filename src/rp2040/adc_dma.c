@@ -0,0 +1,96 @@
+// Scanning of all configured ADC channels using DMA on rp2040
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "board/misc.h" // timer_from_us
+#include "hardware/regs/dreq.h" // DREQ_ADC
+#include "hardware/structs/adc.h" // adc_hw
+#include "hardware/structs/dma.h" // dma_hw
+#include "hardware/structs/resets.h" // RESETS_RESET_DMA_BITS
+#include "internal.h" // adc_scan_add
+
+#define ADC_DMA_CHAN 7
+#define ADC_OVERSAMPLE 8        // Conversions averaged for each reading
+#define ADC_CHANNELS 5
+
+// The adc converts the channels in adc_scan_mask in round-robin order
+// (starting from the lowest channel) and dma copies each result from
+// the adc fifo into adc_scan_buf.
+static uint16_t adc_scan_buf[ADC_CHANNELS * ADC_OVERSAMPLE];
+static uint8_t adc_scan_mask, adc_scan_ready, adc_scan_active;
+
+// Add a channel to the scan
+void
+adc_scan_add(uint32_t chan)
+{
+    adc_scan_mask |= 1 << chan;
+}
+
+// Start a new scan of all channels
+static uint32_t
+adc_scan_start(void)
+{
+    uint32_t cs = adc_hw->cs;
+    if (!(cs & ADC_CS_READY_BITS))
+        // Wait for final conversion of the last scan to complete
+        return timer_from_us(5);
+    adc_hw->cs = ((cs & ADC_CS_TS_EN_BITS) | ADC_CS_EN_BITS
+                  | (__builtin_ctz(adc_scan_mask) << ADC_CS_AINSEL_LSB)
+                  | (adc_scan_mask << ADC_CS_RROBIN_LSB));
+    while (!(adc_hw->fcs & ADC_FCS_EMPTY_BITS))
+        adc_hw->fifo;
+    adc_hw->fcs = (ADC_FCS_EN_BITS | ADC_FCS_DREQ_EN_BITS | ADC_FCS_OVER_BITS
+                   | ADC_FCS_UNDER_BITS | (1 << ADC_FCS_THRESH_LSB));
+
+    if (!is_enabled_pclock(RESETS_RESET_DMA_BITS))
+        enable_pclock(RESETS_RESET_DMA_BITS);
+    uint32_t count = __builtin_popcount(adc_scan_mask) * ADC_OVERSAMPLE;
+    dma_channel_hw_t *ch = &dma_hw->ch[ADC_DMA_CHAN];
+    ch->read_addr = (uint32_t)&adc_hw->fifo;
+    ch->write_addr = (uint32_t)adc_scan_buf;
+    ch->transfer_count = count;
+    ch->ctrl_trig = (DMA_CH0_CTRL_TRIG_EN_BITS
+                     | (1 << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB)
+                     | DMA_CH0_CTRL_TRIG_INCR_WRITE_BITS
+                     | (ADC_DMA_CHAN << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB)
+                     | (DREQ_ADC << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB)
+                     | DMA_CH0_CTRL_TRIG_IRQ_QUIET_BITS);
+    adc_hw->cs |= ADC_CS_START_MANY_BITS;
+    adc_scan_active = 1;
+    adc_scan_ready = 0;
+    return timer_from_us(2 * count + 5); // Each conversion takes 2us
+}
+
+// Check if a reading for the channel is available from a completed
+// scan (starting a new scan if not). Returns zero if the reading is
+// ready, otherwise the number of clock ticks to wait before retrying.
+uint32_t
+adc_scan_sample(uint32_t chan)
+{
+    if (adc_scan_active) {
+        if (dma_hw->ch[ADC_DMA_CHAN].ctrl_trig & DMA_CH0_CTRL_TRIG_BUSY_BITS)
+            // Scan still in progress
+            return timer_from_us(10);
+        adc_hw->cs &= ~ADC_CS_START_MANY_BITS;
+        adc_scan_active = 0;
+        adc_scan_ready = adc_scan_mask;
+    }
+    if (adc_scan_ready & (1 << chan))
+        return 0;
+    return adc_scan_start();
+}
+
+// Return the average of the channel's conversions in the last scan
+uint16_t
+adc_scan_read(uint32_t chan)
+{
+    adc_scan_ready &= ~(1 << chan);
+    uint32_t count = __builtin_popcount(adc_scan_mask);
+    uint32_t pos = __builtin_popcount(adc_scan_mask & ((1 << chan) - 1));
+    uint32_t i, sum = 0;
+    for (i=0; i<ADC_OVERSAMPLE; i++)
+        sum += adc_scan_buf[i * count + pos] & 0xfff;
+    return (sum + ADC_OVERSAMPLE / 2) / ADC_OVERSAMPLE;
+}
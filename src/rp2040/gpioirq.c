@@ -0,0 +1,90 @@
+// Pin change interrupts on rp2040
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <string.h> // ffs, memset
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/gpioirq.h" // gpio_irq_setup
+#include "board/misc.h" // timer_read_time
+#include "hardware/structs/iobank0.h" // iobank0_hw
+#include "internal.h" // IO_IRQ_BANK0_IRQn
+#include "sched.h" // DECL_SHUTDOWN
+
+// Each gpio has four interrupt bits (level low, level high, edge
+// low, edge high) in its intr/inte register
+#define EDGE_LOW_BIT 2
+#define EDGE_HIGH_BIT 3
+#define PIN_BITS(pin, bits) ((bits) << (((pin) % 8) * 4))
+
+static struct gpio_irq *gpio_irqs[30];
+
+// Disable a pin change interrupt (and discard any pending edge)
+void
+gpio_irq_disable(struct gpio_irq *gi)
+{
+    uint32_t pin = gi->pin, reg = pin / 8;
+    uint32_t bits = PIN_BITS(pin, (1 << EDGE_LOW_BIT) | (1 << EDGE_HIGH_BIT));
+    hw_clear_bits(&iobank0_hw->proc0_irq_ctrl.inte[reg], bits);
+    iobank0_hw->intr[reg] = bits;
+}
+
+// Invoke the callback (once) on the next rising or falling edge
+void
+gpio_irq_enable(struct gpio_irq *gi, uint_fast8_t rising)
+{
+    gpio_irq_disable(gi);
+    uint32_t pin = gi->pin;
+    uint32_t bit = PIN_BITS(pin, 1 << (rising ? EDGE_HIGH_BIT : EDGE_LOW_BIT));
+    hw_set_bits(&iobank0_hw->proc0_irq_ctrl.inte[pin / 8], bit);
+}
+
+// Main pin change irq handler
+void
+IO_IRQ_BANK0_IRQHandler(void)
+{
+    uint32_t time = timer_read_time();
+    int i;
+    for (i=0; i<ARRAY_SIZE(iobank0_hw->proc0_irq_ctrl.ints); i++) {
+        uint32_t ints = iobank0_hw->proc0_irq_ctrl.ints[i];
+        while (ints) {
+            uint32_t pin = i * 8 + (ffs(ints) - 1) / 4;
+            ints &= ~PIN_BITS(pin, 0xf);
+            struct gpio_irq *gi = gpio_irqs[pin];
+            gpio_irq_disable(gi);
+            gi->func(gi, time);
+        }
+    }
+}
+
+// Register a pin for pin change interrupts (returns -1 if not available)
+int
+gpio_irq_setup(struct gpio_irq *gi, uint32_t pin)
+{
+    if (pin >= ARRAY_SIZE(gpio_irqs) || gpio_irqs[pin])
+        return -1;
+    gi->pin = pin;
+    gpio_irqs[pin] = gi;
+    gpio_irq_disable(gi);
+    armcm_enable_irq(IO_IRQ_BANK0_IRQHandler, IO_IRQ_BANK0_IRQn, 1);
+    return 0;
+}
+
+// Disable all pin change interrupts (their handlers stay registered)
+void
+gpio_irq_shutdown(void)
+{
+    int i;
+    for (i=0; i<ARRAY_SIZE(gpio_irqs); i++)
+        if (gpio_irqs[i])
+            gpio_irq_disable(gpio_irqs[i]);
+}
+DECL_SHUTDOWN(gpio_irq_shutdown);
+
+// Forget all registered handlers - called from config_reset()
+void
+gpio_irq_reset(void)
+{
+    memset(gpio_irqs, 0, sizeof(gpio_irqs));
+}
@@ -13,6 +13,9 @@ void reset_to_usb_boot(uint32_t gpio_activity_pin_mask
 void connect_internal_flash(void);
 void flash_exit_xip(void);
 void flash_flush_cache(void);
+void adc_scan_add(uint32_t chan);
+uint32_t adc_scan_sample(uint32_t chan);
+uint16_t adc_scan_read(uint32_t chan);
 
 // Force a function to run from ram
 #define UNIQSEC __FILE__ "." __stringify(__LINE__)
@@ -0,0 +1,364 @@
+// Step pulse generation using PIO state machines fed by DMA on rp2040
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "autoconf.h" // CONFIG_CLOCK_FREQ
+#include "board/irq.h" // irq_save
+#include "board/misc.h" // timer_read_time
+#include "board/stepdma.h" // stepdma_setup
+#include "command.h" // shutdown
+#include "hardware/regs/dreq.h" // DREQ_PIO1_TX0
+#include "hardware/structs/dma.h" // dma_hw
+#include "hardware/structs/iobank0.h" // iobank0_hw
+#include "hardware/structs/pio.h" // pio1_hw
+#include "hardware/structs/resets.h" // RESETS_RESET_PIO1_BITS
+#include "hardware/structs/sio.h" // sio_hw
+#include "internal.h" // enable_pclock
+#include "sched.h" // sched_shutdown
+
+
+/****************************************************************
+ * PIO program
+ ****************************************************************/
+
+// Each 32bit word sent to a state machine describes one step pin
+// edge: bit 0 is the dir pin level, bit 1 is the new step pin level,
+// and bits 2-31 are the number of cycles to wait after the previous
+// edge (minus EDGE_CYCLES).
+//
+//  0: out pins, 1 [3]  ; set dir pin (held a few cycles past last edge)
+//  1: out y, 1         ; load new step pin level
+//  2: out x, 30        ; load delay
+//  3: jmp x--, 3       ; wait
+//  4: jmp !y, 7
+//  5: set pins, 1      ; step pin high
+//  6: jmp 0
+//  7: set pins, 0 [1]  ; step pin low (and wrap to 0)
+static const uint16_t stepdma_program[] = {
+    0x6301, 0x6041, 0x603e, 0x0043, 0x0067, 0xe001, 0x0000, 0xe100,
+};
+#define PROGRAM_WRAP_TOP 7
+
+// Cycles between two edges in addition to the programmed delay
+#define EDGE_CYCLES 10
+// Approximate cycles from starting dma on an idle state machine to an edge
+#define START_CYCLES 20
+
+// Instructions executed directly on a state machine
+#define INSN_JMP_0 0x0000
+#define INSN_SET_PINS_0 0xe000
+#define INSN_SET_PINDIRS_1 0xe081
+#define INSN_MOV_PINS_NULL 0xa003
+
+
+/****************************************************************
+ * Edge buffer
+ ****************************************************************/
+
+#define STEPDMA_COUNT 4         // One stepper per PIO1 state machine
+#define STEPDMA_SIZE 64         // Buffered edges per stepper (power of 2)
+#define STEPDMA_DMA_CHAN 8      // Uses dma channels 8-11
+#define FIFO_SLOTS 9            // Edges held in the joined tx fifo and osr
+#define REFILL_MARGIN 4         // Refill when this many edges remain
+#define MAX_GAP timer_from_us(100000)
+
+struct stepdma {
+    // The words array must be first (dma ring buffers must be aligned)
+    uint32_t words[STEPDMA_SIZE];
+    uint32_t times[STEPDMA_SIZE];
+    uint32_t last_time, cycle_frac, pulse_ticks, dma_ctrl;
+    uint16_t run_start, done_pos, dma_pos, push_pos;
+    uint8_t sm, step_pin, flags;
+} __aligned(STEPDMA_SIZE * 4);
+
+enum { SDF_LEVEL=1<<1, SDF_EDGE=1<<2 };
+
+static struct stepdma stepdmas[STEPDMA_COUNT];
+static uint8_t stepdma_count;
+static uint32_t cycles_per_tick, cycles_per_tick_frac;
+
+// Convert a duration in timer ticks to pio cycles
+static uint32_t
+ticks_to_cycles(uint32_t ticks, uint32_t *pfrac)
+{
+    uint64_t frac = (uint64_t)ticks * cycles_per_tick_frac + *pfrac;
+    *pfrac = frac;
+    return ticks * cycles_per_tick + (uint32_t)(frac >> 32);
+}
+
+static dma_channel_hw_t *
+stepdma_chan(struct stepdma *sd)
+{
+    return &dma_hw->ch[STEPDMA_DMA_CHAN + sd->sm];
+}
+
+// Queue an edge (the fractional cycle remainder is carried between
+// edges so that there is no long term drift)
+static void
+add_edge(struct stepdma *sd, uint32_t edgetime, uint32_t bits)
+{
+    uint32_t cycles = ticks_to_cycles(edgetime - sd->last_time
+                                      , &sd->cycle_frac);
+    uint32_t delay = cycles > EDGE_CYCLES ? cycles - EDGE_CYCLES : 0;
+    uint32_t idx = sd->push_pos++ % STEPDMA_SIZE;
+    sd->words[idx] = (delay << 2) | bits;
+    sd->times[idx] = edgetime;
+    sd->last_time = edgetime;
+}
+
+// Check if all queued edges have been output
+static int
+is_idle(struct stepdma *sd, uint32_t now)
+{
+    return (sd->push_pos == sd->run_start
+            || (sd->dma_pos == sd->push_pos
+                && !timer_is_before(now, sd->last_time)));
+}
+
+// Queue a step at the given time - returns 0 if it can not be queued yet
+uint_fast8_t
+stepdma_push(struct stepdma *sd, uint32_t steptime, uint_fast8_t dir)
+{
+    uint32_t now = timer_read_time();
+    if (is_idle(sd, now)) {
+        // Start a new run of edges (timed from the dma start)
+        if (timer_is_before(now + MAX_GAP, steptime))
+            return 0;
+        sd->run_start = sd->push_pos;
+        sd->last_time = now;
+        sd->cycle_frac = 0;
+    } else if (timer_is_before(sd->last_time + MAX_GAP, steptime)) {
+        return 0;
+    }
+    uint_fast8_t edges = sd->flags & SDF_EDGE ? 1 : 2;
+    dma_channel_hw_t *ch = stepdma_chan(sd);
+    sd->done_pos = sd->dma_pos;
+    if (ch->ctrl_trig & DMA_CH0_CTRL_TRIG_BUSY_BITS)
+        sd->done_pos -= ch->transfer_count;
+    if ((uint16_t)(sd->push_pos - sd->done_pos) + edges
+        > STEPDMA_SIZE - FIFO_SLOTS)
+        return 0;
+
+    int32_t diff = steptime - sd->last_time;
+    if (diff < 0) {
+        if (diff < (int32_t)-timer_from_us(1000))
+            shutdown("Stepper too far in past");
+        steptime = sd->last_time;
+    }
+    uint32_t bits = dir ? 1 : 0;
+    if (sd->flags & SDF_EDGE) {
+        // Step on each edge of the step pin
+        sd->flags ^= SDF_LEVEL;
+        add_edge(sd, steptime, bits | (sd->flags & SDF_LEVEL));
+        return 1;
+    }
+    // Regular step pulse - keep the step pin low for the pulse duration
+    uint32_t min_time = sd->last_time + sd->pulse_ticks;
+    if (sd->push_pos != sd->run_start && timer_is_before(steptime, min_time))
+        steptime = min_time;
+    add_edge(sd, steptime, bits | SDF_LEVEL);
+    add_edge(sd, steptime + sd->pulse_ticks, bits);
+    return 1;
+}
+
+// Start output of queued edges.  Returns 0 if all edges have been
+// output, otherwise stores in 'pnext' the time to queue more edges by.
+uint_fast8_t
+stepdma_flush(struct stepdma *sd, uint32_t *pnext)
+{
+    dma_channel_hw_t *ch = stepdma_chan(sd);
+    uint32_t now = timer_read_time();
+    if (sd->dma_pos != sd->push_pos
+        && !(ch->ctrl_trig & DMA_CH0_CTRL_TRIG_BUSY_BITS)) {
+        uint32_t idx = sd->dma_pos % STEPDMA_SIZE;
+        uint32_t prev = sd->times[(sd->dma_pos - 1) % STEPDMA_SIZE];
+        if (sd->dma_pos == sd->run_start || !timer_is_before(now, prev)) {
+            // State machine is idle - time first edge relative to now
+            uint32_t frac = 0;
+            now = timer_read_time();
+            int32_t diff = sd->times[idx] - now;
+            uint32_t cycles = diff > 0 ? ticks_to_cycles(diff, &frac) : 0;
+            uint32_t delay = cycles > START_CYCLES ? cycles - START_CYCLES : 0;
+            sd->words[idx] = (delay << 2) | (sd->words[idx] & 0x03);
+        }
+        ch->read_addr = (uint32_t)&sd->words[idx];
+        ch->write_addr = (uint32_t)&pio1_hw->txf[sd->sm];
+        ch->transfer_count = (uint16_t)(sd->push_pos - sd->dma_pos);
+        ch->ctrl_trig = sd->dma_ctrl;
+        sd->dma_pos = sd->push_pos;
+    }
+
+    if (is_idle(sd, now)) {
+        sd->run_start = sd->push_pos;
+        return 0;
+    }
+    // Request more edges shortly before the state machine runs out
+    uint32_t next = sd->times[(sd->dma_pos - 1) % STEPDMA_SIZE];
+    uint16_t pos = sd->dma_pos - 1 - REFILL_MARGIN;
+    if ((int16_t)(pos - sd->run_start) >= 0
+        && (uint16_t)(sd->push_pos - pos) <= STEPDMA_SIZE) {
+        uint32_t early = sd->times[pos % STEPDMA_SIZE];
+        if (timer_is_before(now, early))
+            next = early;
+    }
+    *pnext = next;
+    return 1;
+}
+
+// Return the steps queued but not yet output (steps with the dir pin
+// set count as +1 and other steps count as -1)
+static int32_t
+count_pending(struct stepdma *sd, uint32_t now)
+{
+    int32_t pending = 0;
+    uint16_t pos = sd->push_pos;
+    int i;
+    for (i=0; i<STEPDMA_SIZE && pos != sd->run_start; i++) {
+        pos--;
+        uint32_t idx = pos % STEPDMA_SIZE;
+        if (!timer_is_before(now, sd->times[idx]))
+            break;
+        uint32_t word = sd->words[idx];
+        if (sd->flags & SDF_EDGE || word & SDF_LEVEL)
+            pending += word & 0x01 ? 1 : -1;
+    }
+    return pending;
+}
+
+// Report steps not yet output (caller must disable irqs)
+int32_t
+stepdma_pending(struct stepdma *sd)
+{
+    return count_pending(sd, timer_read_time());
+}
+
+// Halt the dma channel feeding a state machine
+static void
+abort_dma(struct stepdma *sd)
+{
+    uint32_t chan_bit = 1 << (STEPDMA_DMA_CHAN + sd->sm);
+    stepdma_chan(sd)->al1_ctrl = 0;
+    dma_hw->abort = chan_bit;
+    while (dma_hw->abort & chan_bit)
+        ;
+}
+
+// Discard all queued edges and set the dir pin low.  Returns the steps
+// that were not output (caller must disable irqs)
+int32_t
+stepdma_stop(struct stepdma *sd)
+{
+    uint32_t now = timer_read_time(), sm = sd->sm;
+    pio1_hw->ctrl &= ~(1 << sm);
+    int32_t pending = count_pending(sd, now);
+
+    // Stop dma and clear the fifo
+    abort_dma(sd);
+    struct pio_sm_hw *smhw = &pio1_hw->sm[sm];
+    smhw->shiftctrl ^= PIO_SM0_SHIFTCTRL_FJOIN_TX_BITS;
+    smhw->shiftctrl ^= PIO_SM0_SHIFTCTRL_FJOIN_TX_BITS;
+
+    // Restart state machine
+    pio1_hw->ctrl |= 1 << (PIO_CTRL_SM_RESTART_LSB + sm);
+    smhw->instr = INSN_JMP_0;
+    smhw->instr = INSN_MOV_PINS_NULL;
+    if (sd->flags & SDF_EDGE) {
+        // Step pin retains its level - note it for the next edge
+        if (sio_hw->gpio_in & (1 << sd->step_pin))
+            sd->flags |= SDF_LEVEL;
+        else
+            sd->flags &= ~SDF_LEVEL;
+    } else {
+        smhw->instr = INSN_SET_PINS_0;
+    }
+    pio1_hw->ctrl |= 1 << sm;
+    sd->run_start = sd->done_pos = sd->dma_pos = sd->push_pos;
+    return pending;
+}
+
+// Assign a state machine and dma channel to a stepper (returns NULL
+// if none available)
+struct stepdma *
+stepdma_setup(uint32_t step_pin, uint32_t dir_pin, int32_t invert_step
+              , uint32_t pulse_ticks)
+{
+    if (stepdma_count >= STEPDMA_COUNT || step_pin >= 30 || dir_pin >= 30)
+        return NULL;
+    if (!stepdma_count) {
+        enable_pclock(RESETS_RESET_PIO1_BITS);
+        if (!is_enabled_pclock(RESETS_RESET_DMA_BITS))
+            enable_pclock(RESETS_RESET_DMA_BITS);
+        int i;
+        for (i=0; i<ARRAY_SIZE(stepdma_program); i++)
+            pio1_hw->instr_mem[i] = stepdma_program[i];
+        uint32_t pclk = get_pclock_frequency(RESETS_RESET_PIO1_RESET);
+        cycles_per_tick = pclk / CONFIG_CLOCK_FREQ;
+        cycles_per_tick_frac = (((uint64_t)(pclk % CONFIG_CLOCK_FREQ) << 32)
+                                / CONFIG_CLOCK_FREQ);
+    }
+    uint32_t sm = stepdma_count++;
+    struct stepdma *sd = &stepdmas[sm];
+    sd->sm = sm;
+    sd->step_pin = step_pin;
+    sd->pulse_ticks = pulse_ticks;
+    sd->flags = invert_step < 0 ? SDF_EDGE : 0;
+    sd->dma_ctrl = (DMA_CH0_CTRL_TRIG_EN_BITS
+                    | (2 << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB)
+                    | DMA_CH0_CTRL_TRIG_INCR_READ_BITS
+                    | (__builtin_ctz(sizeof(sd->words))
+                       << DMA_CH0_CTRL_TRIG_RING_SIZE_LSB)
+                    | ((STEPDMA_DMA_CHAN + sm)
+                       << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB)
+                    | ((DREQ_PIO1_TX0 + sm) << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB)
+                    | DMA_CH0_CTRL_TRIG_IRQ_QUIET_BITS);
+
+    // Configure state machine
+    struct pio_sm_hw *smhw = &pio1_hw->sm[sm];
+    smhw->clkdiv = 1 << PIO_SM0_CLKDIV_INT_LSB;
+    smhw->execctrl = PROGRAM_WRAP_TOP << PIO_SM0_EXECCTRL_WRAP_TOP_LSB;
+    smhw->shiftctrl = (PIO_SM0_SHIFTCTRL_AUTOPULL_BITS
+                       | PIO_SM0_SHIFTCTRL_OUT_SHIFTDIR_BITS
+                       | PIO_SM0_SHIFTCTRL_FJOIN_TX_BITS);
+    smhw->pinctrl = ((1 << PIO_SM0_PINCTRL_SET_COUNT_LSB)
+                     | (dir_pin << PIO_SM0_PINCTRL_SET_BASE_LSB));
+    smhw->instr = INSN_SET_PINS_0;
+    smhw->instr = INSN_SET_PINDIRS_1;
+    smhw->pinctrl = ((1 << PIO_SM0_PINCTRL_SET_COUNT_LSB)
+                     | (step_pin << PIO_SM0_PINCTRL_SET_BASE_LSB)
+                     | (1 << PIO_SM0_PINCTRL_OUT_COUNT_LSB)
+                     | (dir_pin << PIO_SM0_PINCTRL_OUT_BASE_LSB));
+    smhw->instr = INSN_SET_PINS_0;
+    smhw->instr = INSN_SET_PINDIRS_1;
+    smhw->instr = INSN_JMP_0;
+
+    // Route pins to the state machine
+    gpio_peripheral(dir_pin, 7, 0);
+    gpio_peripheral(step_pin, 7, 0);
+    if (invert_step > 0)
+        iobank0_hw->io[step_pin].ctrl |= (
+            IO_BANK0_GPIO0_CTRL_OUTOVER_VALUE_INVERT
+            << IO_BANK0_GPIO0_CTRL_OUTOVER_LSB);
+    irqstatus_t flag = irq_save();
+    pio1_hw->ctrl |= 1 << sm;
+    irq_restore(flag);
+    return sd;
+}
+
+// Release all state machines (caller must disable irqs)
+void
+stepdma_reset(void)
+{
+    if (!stepdma_count)
+        return;
+    int i;
+    for (i=0; i<stepdma_count; i++) {
+        struct stepdma *sd = &stepdmas[i];
+        abort_dma(sd);
+        iobank0_hw->io[sd->step_pin].ctrl &= ~IO_BANK0_GPIO0_CTRL_OUTOVER_BITS;
+    }
+    // Hold pio1 in reset (stepdma_setup() releases it again)
+    resets_hw->reset |= RESETS_RESET_PIO1_BITS;
+    stepdma_count = 0;
+}
@@ -4,6 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_STEPPER_TIMERS
 #include "board/armcm_boot.h" // armcm_enable_irq
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_read_time
@@ -55,6 +56,95 @@ TIMER0_IRQHandler(void)
     irq_enable();
 }
 
+
+
+/****************************************************************
+ * Dedicated timer channels
+ ****************************************************************/
+
+// Alarms 1-3 may be assigned to individual timers (eg, steppers)
+#define NUM_CHANNELS 3
+
+static struct timer *channel_timers[NUM_CHANNELS];
+
+// Dispatch the timer assigned to a channel
+static inline void
+channel_dispatch(uint32_t chan)
+{
+    irq_disable();
+    uint32_t bit = 1 << (chan + 1);
+    if (timer_hw->ints & bit) {
+        timer_hw->intr = bit;
+        uint32_t next;
+        if (timer_dispatch_channel(channel_timers[chan], &next))
+            timer_hw->alarm[chan + 1] = next;
+    }
+    irq_enable();
+}
+
+void __aligned(16)
+TIMER1_IRQHandler(void)
+{
+    channel_dispatch(0);
+}
+
+void __aligned(16)
+TIMER2_IRQHandler(void)
+{
+    channel_dispatch(1);
+}
+
+void __aligned(16)
+TIMER3_IRQHandler(void)
+{
+    channel_dispatch(2);
+}
+
+// Assign a timer to a free channel (returns -1 if none available)
+int8_t
+timer_channel_alloc(struct timer *t)
+{
+    int i;
+    for (i=0; i<NUM_CHANNELS; i++) {
+        if (channel_timers[i])
+            continue;
+        channel_timers[i] = t;
+        irqstatus_t flag = irq_save();
+        timer_hw->inte |= 1 << (i + 1);
+        irq_restore(flag);
+        return i;
+    }
+    return -1;
+}
+
+// Schedule the timer assigned to a channel (caller must disable irqs)
+void
+timer_channel_add(uint8_t chan)
+{
+    timer_hw->alarm[chan + 1] = timer_channel_start(channel_timers[chan]);
+}
+
+// Cancel the timer assigned to a channel (caller must disable irqs)
+void
+timer_channel_del(uint8_t chan)
+{
+    uint32_t bit = 1 << (chan + 1);
+    timer_hw->armed = bit;
+    timer_hw->intr = bit;
+}
+
+// Release all channels
+void
+timer_channel_reset(void)
+{
+    int i;
+    for (i=0; i<NUM_CHANNELS; i++) {
+        timer_channel_del(i);
+        channel_timers[i] = NULL;
+    }
+    timer_hw->inte = 1;
+}
+
 void
 timer_init(void)
 {
@@ -63,6 +153,11 @@ timer_init(void)
     timer_hw->timelw = 0;
     timer_hw->timehw = 0;
     armcm_enable_irq(TIMER0_IRQHandler, TIMER_IRQ_0_IRQn, 2);
+    if (CONFIG_STEPPER_TIMERS) {
+        armcm_enable_irq(TIMER1_IRQHandler, TIMER_IRQ_1_IRQn, 2);
+        armcm_enable_irq(TIMER2_IRQHandler, TIMER_IRQ_2_IRQn, 2);
+        armcm_enable_irq(TIMER3_IRQHandler, TIMER_IRQ_3_IRQn, 2);
+    }
     timer_hw->inte = 1;
     timer_kick();
     irq_enable();
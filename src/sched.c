@@ -12,6 +12,7 @@
 #include "board/misc.h" // timer_from_us
 #include "board/pgm.h" // READP
 #include "command.h" // shutdown
+#include "histogram.h" // histogram_timer_dispatch
 #include "sched.h" // sched_check_periodic
 #include "stepper.h" // stepper_event
 
@@ -23,6 +24,14 @@ static struct {
     uint8_t shutdown_status, shutdown_reason;
 } SchedStatus = {.timer_list = &periodic_timer, .last_insert = &periodic_timer};
 
+#if CONFIG_SCHED_TIMER_HEAP
+// Pending timers when CONFIG_SCHED_TIMER_HEAP is enabled
+static struct timer *TimerHeap[CONFIG_SCHED_TIMER_HEAP_SIZE] = {
+    &periodic_timer
+};
+static unsigned int TimerHeapCount = 1;
+#endif
+
 
 /****************************************************************
  * Timers
@@ -81,12 +90,94 @@ insert_timer(struct timer *pos, struct timer *t, uint32_t waketime)
     prev->next = t;
 }
 
+#if CONFIG_SCHED_TIMER_HEAP
+// Move a timer towards the top of TimerHeap until it is in order
+static void
+heap_sift_up(unsigned int pos, struct timer *t)
+{
+    uint32_t waketime = t->waketime;
+    while (pos) {
+        unsigned int parent = (pos - 1) / 2;
+        struct timer *p = TimerHeap[parent];
+        if (!timer_is_before(waketime, p->waketime))
+            break;
+        TimerHeap[pos] = p;
+        p->heap_pos = pos;
+        pos = parent;
+    }
+    TimerHeap[pos] = t;
+    t->heap_pos = pos;
+}
+
+// Move a timer towards the bottom of TimerHeap until it is in order
+static void
+heap_sift_down(unsigned int pos, struct timer *t)
+{
+    uint32_t waketime = t->waketime;
+    unsigned int count = TimerHeapCount;
+    for (;;) {
+        unsigned int child = pos * 2 + 1;
+        if (child >= count)
+            break;
+        struct timer *c = TimerHeap[child];
+        if (child + 1 < count
+            && timer_is_before(TimerHeap[child + 1]->waketime, c->waketime))
+            c = TimerHeap[++child];
+        if (!timer_is_before(c->waketime, waketime))
+            break;
+        TimerHeap[pos] = c;
+        c->heap_pos = pos;
+        pos = child;
+    }
+    TimerHeap[pos] = t;
+    t->heap_pos = pos;
+}
+
+// Add a timer to TimerHeap
+static void
+heap_insert(struct timer *t)
+{
+    unsigned int count = TimerHeapCount;
+    if (count >= ARRAY_SIZE(TimerHeap))
+        shutdown("Too many scheduled timers");
+    TimerHeapCount = count + 1;
+    heap_sift_up(count, t);
+}
+
+// Remove the timer at a given position (other than the first) of TimerHeap
+static void
+heap_remove(unsigned int pos)
+{
+    unsigned int count = --TimerHeapCount;
+    if (pos == count)
+        return;
+    struct timer *last = TimerHeap[count];
+    if (timer_is_before(last->waketime, TimerHeap[(pos - 1) / 2]->waketime))
+        heap_sift_up(pos, last);
+    else
+        heap_sift_down(pos, last);
+}
+#endif
+
 // Schedule a function call at a supplied time.
 void
 sched_add_timer(struct timer *add)
 {
     uint32_t waketime = add->waketime;
     irqstatus_t flag = irq_save();
+#if CONFIG_SCHED_TIMER_HEAP
+    struct timer *tl = TimerHeap[0];
+    if (unlikely(timer_is_before(waketime, tl->waketime))) {
+        // Place deleted_timer in front of the new timer (as below)
+        if (timer_is_before(waketime, timer_read_time()))
+            try_shutdown("Timer too close");
+        deleted_timer.waketime = waketime;
+        if (tl != &deleted_timer)
+            heap_insert(&deleted_timer);
+        timer_kick();
+    }
+    heap_insert(add);
+#else
     struct timer *tl = SchedStatus.timer_list;
     if (unlikely(timer_is_before(waketime, tl->waketime))) {
         // This timer is before all other scheduled timers
@@ -103,6 +194,7 @@ sched_add_timer(struct timer *add)
     } else {
         insert_timer(tl, add, waketime);
     }
+#endif
     irq_restore(flag);
 }
 
@@ -122,6 +214,20 @@ void
 sched_del_timer(struct timer *del)
 {
     irqstatus_t flag = irq_save();
+#if CONFIG_SCHED_TIMER_HEAP
+    // The heap_pos of a timer not in TimerHeap may be stale
+    unsigned int pos = del->heap_pos;
+    if (pos < TimerHeapCount && TimerHeap[pos] == del) {
+        if (!pos) {
+            // Deleting the next active timer - replace with deleted_timer
+            deleted_timer.waketime = del->waketime;
+            deleted_timer.heap_pos = 0;
+            TimerHeap[0] = &deleted_timer;
+        } else {
+            heap_remove(pos);
+        }
+    }
+#else
     if (SchedStatus.timer_list == del) {
         // Deleting the next active timer - replace with deleted_timer
         deleted_timer.waketime = del->waketime;
@@ -139,6 +245,7 @@ sched_del_timer(struct timer *del)
     }
     if (SchedStatus.last_insert == del)
         SchedStatus.last_insert = &periodic_timer;
+#endif
     irq_restore(flag);
 }
 
@@ -147,9 +254,15 @@ unsigned int
 sched_timer_dispatch(void)
 {
     // Invoke timer callback
+#if CONFIG_SCHED_TIMER_HEAP
+    struct timer *t = TimerHeap[0];
+#else
     struct timer *t = SchedStatus.timer_list;
+#endif
     uint_fast8_t res;
     uint32_t updated_waketime;
+    if (CONFIG_STATS_HISTOGRAMS)
+        histogram_timer_dispatch(t->waketime);
     if (CONFIG_INLINE_STEPPER_HACK && likely(!t->func)) {
         res = stepper_event(t);
         updated_waketime = t->waketime;
@@ -158,6 +271,14 @@ sched_timer_dispatch(void)
         updated_waketime = t->waketime;
     }
 
+#if CONFIG_SCHED_TIMER_HEAP
+    // Update TimerHeap (rescheduling current timer if necessary)
+    if (unlikely(res == SF_DONE))
+        t = TimerHeap[--TimerHeapCount];
+    heap_sift_down(0, t);
+    return TimerHeap[0]->waketime;
+#endif
+
     // Update timer_list (rescheduling current timer if necessary)
     unsigned int next_waketime = updated_waketime;
     if (unlikely(res == SF_DONE)) {
@@ -182,10 +303,19 @@ sched_timer_dispatch(void)
 void
 sched_timer_reset(void)
 {
+#if CONFIG_SCHED_TIMER_HEAP
+    deleted_timer.waketime = periodic_timer.waketime;
+    TimerHeap[0] = &deleted_timer;
+    TimerHeap[1] = &periodic_timer;
+    deleted_timer.heap_pos = 0;
+    periodic_timer.heap_pos = 1;
+    TimerHeapCount = 2;
+#else
     SchedStatus.timer_list = &deleted_timer;
     deleted_timer.waketime = periodic_timer.waketime;
     deleted_timer.next = SchedStatus.last_insert = &periodic_timer;
     periodic_timer.next = &sentinel_timer;
+#endif
     timer_kick();
 }
 
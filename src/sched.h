@@ -13,7 +13,10 @@
 
 // Timer structure for scheduling timed events (see sched_add_timer() )
 struct timer {
-    struct timer *next;
+    union {
+        struct timer *next;
+        unsigned int heap_pos; // Index in TimerHeap (SCHED_TIMER_HEAP)
+    };
     uint_fast8_t (*func)(struct timer*);
     uint32_t waketime;
 };
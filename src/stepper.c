@@ -9,7 +9,10 @@
 #include "board/gpio.h" // gpio_out_write
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_is_before
+#include "board/stepdma.h" // stepdma_push
+#include "board/timer_irq.h" // timer_channel_add
 #include "command.h" // DECL_COMMAND
+#include "compiler.h" // DIV_ROUND_UP
 #include "sched.h" // struct timer
 #include "stepper.h" // stepper_event
 #include "trsync.h" // trsync_add_signal
@@ -31,13 +34,13 @@
 
 struct stepper_move {
     struct move_node node;
-    uint32_t interval;
     int16_t add;
+    uint32_t interval;
     uint16_t count;
-    uint8_t flags;
 };
 
-enum { MF_DIR=1<<0 };
+// The direction change flag is stored in the high bit of the interval
+#define MF_DIR (1UL<<31)
 
 struct stepper {
     struct timer time;
@@ -46,9 +49,11 @@ struct stepper {
     uint32_t count;
     uint32_t next_step_time, step_pulse_ticks;
     struct gpio_out step_pin, dir_pin;
-    uint32_t position;
+    uint32_t position, last_queued_interval;
     struct move_queue_head mq;
     struct trsync_signal stop_signal;
+    struct stepdma *dma;
+    int8_t timer_chan;
     // gcc (pre v6) does better optimization when uint8_t are bitfields
     uint8_t flags : 8;
 };
@@ -57,7 +62,7 @@ enum { POSITION_BIAS=0x40000000 };
 
 enum {
     SF_LAST_DIR=1<<0, SF_NEXT_DIR=1<<1, SF_INVERT_STEP=1<<2, SF_NEED_RESET=1<<3,
-    SF_SINGLE_SCHED=1<<4, SF_HAVE_ADD=1<<5
+    SF_SINGLE_SCHED=1<<4, SF_HAVE_ADD=1<<5, SF_DMA_DIR=1<<6, SF_DMA_BUSY=1<<7
 };
 
 // Setup a stepper for the next move in its queue
@@ -73,22 +78,23 @@ stepper_load_next(struct stepper *s)
     // Load next 'struct stepper_move' into 'struct stepper'
     struct move_node *mn = move_queue_pop(&s->mq);
     struct stepper_move *m = container_of(mn, struct stepper_move, node);
+    uint32_t interval = m->interval & ~MF_DIR;
     s->add = m->add;
-    s->interval = m->interval + m->add;
+    s->interval = interval + m->add;
     if (HAVE_SINGLE_SCHEDULE && s->flags & SF_SINGLE_SCHED) {
-        s->time.waketime += m->interval;
+        s->time.waketime += interval;
         if (HAVE_AVR_OPTIMIZATION)
             s->flags = m->add ? s->flags|SF_HAVE_ADD : s->flags & ~SF_HAVE_ADD;
         s->count = m->count;
     } else {
         // It is necessary to schedule unstep events and so there are
         // twice as many events.
-        s->next_step_time += m->interval;
+        s->next_step_time += interval;
         s->time.waketime = s->next_step_time;
         s->count = (uint32_t)m->count * 2;
     }
     // Add all steps to s->position (stepper_get_position() can calc mid-move)
-    if (m->flags & MF_DIR) {
+    if (m->interval & MF_DIR) {
         s->position = -s->position + m->count;
         gpio_out_toggle_noirq(s->dir_pin);
     } else {
@@ -99,38 +105,76 @@ stepper_load_next(struct stepper *s)
     return SF_RESCHEDULE;
 }
 
+// Maximum time a single step event may generate back-to-back steps
+#define STEPPER_BATCH_TICKS timer_from_us(CONFIG_STEPPER_BATCH_US)
+// Steps due this close to the previous step are not returned to sched.c
+#define STEPPER_BATCH_WINDOW_TICKS timer_from_us(2)
+
+#define AVR_STEP_INSNS 40 // minimum instructions between step gpio pulses
+
+// Minimum time between step pin edges generated from one step event
+#define STEPPER_BATCH_MIN_TICKS (HAVE_AVR_OPTIMIZATION ? AVR_STEP_INSNS \
+                                 : DIV_ROUND_UP(CONFIG_CLOCK_FREQ, 10000000))
+
+// Check if the next step should be generated in the current step
+// event (and if so, wait for its scheduled time)
+static __always_inline int
+stepper_batch_wait(uint32_t waketime, uint32_t batch_end)
+{
+    if (!CONFIG_STEPPER_BATCH_US || !timer_is_before(waketime, batch_end))
+        return 0;
+    uint32_t now = timer_read_time();
+    if ((int32_t)(waketime - now) > (int32_t)STEPPER_BATCH_WINDOW_TICKS)
+        return 0;
+    // Keep the minimum pulse spacing even if this event is running late
+    uint32_t min_time = now + STEPPER_BATCH_MIN_TICKS;
+    if (timer_is_before(waketime, min_time))
+        waketime = min_time;
+    // Never busy wait (with irqs disabled) past the end of the batch
+    if (!timer_is_before(waketime, batch_end))
+        return 0;
+    while (timer_is_before(now, waketime))
+        now = timer_read_time();
+    return 1;
+}
+
 // Optimized step function to step on each step pin edge
 uint_fast8_t
 stepper_event_edge(struct timer *t)
 {
     struct stepper *s = container_of(t, struct stepper, time);
-    gpio_out_toggle_noirq(s->step_pin);
-    uint32_t count = s->count - 1;
-    if (likely(count)) {
+    uint32_t batch_end = s->time.waketime + STEPPER_BATCH_TICKS;
+    for (;;) {
+        gpio_out_toggle_noirq(s->step_pin);
+        uint32_t count = s->count - 1;
+        if (unlikely(!count))
+            return stepper_load_next(s);
         s->count = count;
-        s->time.waketime += s->interval;
+        uint32_t waketime = s->time.waketime += s->interval;
         s->interval += s->add;
-        return SF_RESCHEDULE;
+        if (likely(!stepper_batch_wait(waketime, batch_end)))
+            return SF_RESCHEDULE;
     }
-    return stepper_load_next(s);
 }
 
-#define AVR_STEP_INSNS 40 // minimum instructions between step gpio pulses
-
 // AVR optimized step function
 static uint_fast8_t
 stepper_event_avr(struct timer *t)
 {
     struct stepper *s = container_of(t, struct stepper, time);
-    gpio_out_toggle_noirq(s->step_pin);
-    uint16_t *pcount = (void*)&s->count, count = *pcount - 1;
-    if (likely(count)) {
+    uint32_t batch_end = s->time.waketime + STEPPER_BATCH_TICKS;
+    for (;;) {
+        gpio_out_toggle_noirq(s->step_pin);
+        uint16_t *pcount = (void*)&s->count, count = *pcount - 1;
+        if (unlikely(!count))
+            break;
         *pcount = count;
-        s->time.waketime += s->interval;
+        uint32_t waketime = s->time.waketime += s->interval;
         gpio_out_toggle_noirq(s->step_pin);
         if (s->flags & SF_HAVE_ADD)
             s->interval += s->add;
-        return SF_RESCHEDULE;
+        if (likely(!stepper_batch_wait(waketime, batch_end)))
+            return SF_RESCHEDULE;
     }
     uint_fast8_t ret = stepper_load_next(s);
     gpio_out_toggle_noirq(s->step_pin);
@@ -181,6 +225,76 @@ stepper_event(struct timer *t)
     return stepper_event_full(t);
 }
 
+// Time to start queuing a step into the hardware buffer of a dma stepper
+#define STEPDMA_LEAD_TICKS timer_from_us(100)
+
+// Setup a dma stepper for the next move in its queue
+static uint_fast8_t
+stepper_load_next_dma(struct stepper *s)
+{
+    if (move_queue_empty(&s->mq))
+        return SF_DONE;
+    struct move_node *mn = move_queue_pop(&s->mq);
+    struct stepper_move *m = container_of(mn, struct stepper_move, node);
+    uint32_t interval = m->interval & ~MF_DIR;
+    s->next_step_time += interval;
+    s->interval = interval + m->add;
+    s->add = m->add;
+    s->count = m->count;
+    if (m->interval & MF_DIR) {
+        s->position = -s->position + m->count;
+        s->flags ^= SF_DMA_DIR;
+    } else {
+        s->position += m->count;
+    }
+    move_free(m);
+    return SF_RESCHEDULE;
+}
+
+// Transfer steps from the move queue to the hardware step buffer
+static uint_fast8_t
+stepper_event_dma(struct timer *t)
+{
+    struct stepper *s = container_of(t, struct stepper, time);
+    for (;;) {
+        if (!s->count && stepper_load_next_dma(s) == SF_DONE)
+            break;
+        if (!stepdma_push(s->dma, s->next_step_time, s->flags & SF_DMA_DIR))
+            break;
+        if (--s->count) {
+            s->next_step_time += s->interval;
+            s->interval += s->add;
+        }
+    }
+    uint32_t next;
+    uint_fast8_t active = stepdma_flush(s->dma, &next);
+    if (s->count) {
+        // Wake up in time to queue the next step
+        uint32_t want = s->next_step_time - STEPDMA_LEAD_TICKS;
+        if (!active || (timer_is_before(want, next)
+                        && timer_is_before(timer_read_time(), want)))
+            next = want;
+    } else if (!active) {
+        s->flags &= ~SF_DMA_BUSY;
+        return SF_DONE;
+    }
+    s->time.waketime = next;
+    return SF_RESCHEDULE;
+}
+
+// Start transferring steps of an idle dma stepper
+static void
+stepper_start_dma(struct stepper *s)
+{
+    stepper_load_next_dma(s);
+    s->flags |= SF_DMA_BUSY;
+    uint32_t waketime = s->next_step_time - STEPDMA_LEAD_TICKS;
+    if (timer_is_before(waketime, timer_read_time()))
+        waketime = s->next_step_time;
+    s->time.waketime = waketime;
+    sched_add_timer(&s->time);
+}
+
 void
 command_config_stepper(uint32_t *args)
 {
@@ -205,6 +319,18 @@ command_config_stepper(uint32_t *args)
     } else if (!CONFIG_INLINE_STEPPER_HACK) {
         s->time.func = stepper_event_full;
     }
+    if (CONFIG_STEPPER_DMA)
+        s->dma = stepdma_setup(args[1], args[2], invert_step
+                               , s->step_pulse_ticks);
+    if (CONFIG_STEPPER_DMA && s->dma) {
+        // Steps are output by hardware - the timer only refills its buffer
+        s->flags &= ~SF_SINGLE_SCHED;
+        s->time.func = stepper_event_dma;
+        s->timer_chan = -1;
+    } else {
+        s->timer_chan = (CONFIG_STEPPER_TIMERS
+                         ? timer_channel_alloc(&s->time) : -1);
+    }
 }
 DECL_COMMAND(command_config_stepper, "config_stepper oid=%c step_pin=%c"
              " dir_pin=%c invert_step=%c step_pulse_ticks=%u");
@@ -216,26 +342,48 @@ stepper_oid_lookup(uint8_t oid)
     return oid_lookup(oid, command_config_stepper);
 }
 
+// Schedule the next step event (caller must disable irqs)
+static void
+stepper_add_timer(struct stepper *s)
+{
+    if (CONFIG_STEPPER_TIMERS && s->timer_chan >= 0)
+        timer_channel_add(s->timer_chan);
+    else
+        sched_add_timer(&s->time);
+}
+
+// Cancel any pending step event (caller must disable irqs)
+static void
+stepper_del_timer(struct stepper *s)
+{
+    if (CONFIG_STEPPER_TIMERS && s->timer_chan >= 0)
+        timer_channel_del(s->timer_chan);
+    else
+        sched_del_timer(&s->time);
+}
+
 // Schedule a set of steps with a given timing
-void
-command_queue_step(uint32_t *args)
+static void
+stepper_queue_move(struct stepper *s, uint32_t interval, uint16_t count
+                   , int16_t add)
 {
-    struct stepper *s = stepper_oid_lookup(args[0]);
-    struct stepper_move *m = move_alloc();
-    m->interval = args[1];
-    m->count = args[2];
-    if (!m->count)
+    if (!count)
         shutdown("Invalid count parameter");
-    m->add = args[3];
-    m->flags = 0;
+    if (interval & MF_DIR)
+        shutdown("Invalid interval parameter");
+    s->last_queued_interval = interval + (int32_t)add * (uint16_t)(count - 1);
+    struct stepper_move *m = move_alloc();
+    m->interval = interval;
+    m->count = count;
+    m->add = add;
 
     irq_disable();
     uint8_t flags = s->flags;
     if (!!(flags & SF_LAST_DIR) != !!(flags & SF_NEXT_DIR)) {
         flags ^= SF_LAST_DIR;
-        m->flags |= MF_DIR;
+        m->interval |= MF_DIR;
     }
-    if (s->count) {
+    if (s->count || flags & SF_DMA_BUSY) {
         s->flags = flags;
         move_queue_push(&m->node, &s->mq);
     } else if (flags & SF_NEED_RESET) {
@@ -243,13 +391,36 @@ command_queue_step(uint32_t *args)
     } else {
         s->flags = flags;
         move_queue_push(&m->node, &s->mq);
-        stepper_load_next(s);
-        sched_add_timer(&s->time);
+        if (CONFIG_STEPPER_DMA && s->dma) {
+            stepper_start_dma(s);
+        } else {
+            stepper_load_next(s);
+            stepper_add_timer(s);
+        }
     }
     irq_enable();
 }
-DECL_COMMAND(command_queue_step,
-             "queue_step oid=%c interval=%u count=%hu add=%hi");
+
+void
+command_queue_step(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    stepper_queue_move(s, args[1], args[2], args[3]);
+}
+DECL_COMMAND_FLAGS(command_queue_step, HF_FAST_PARSE,
+                   "queue_step oid=%c interval=%u count=%hu add=%hi");
+
+// Schedule a set of steps with an interval relative to the final step
+// interval of the previously queued move (a more compact queue_step)
+void
+command_queue_step_delta(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    stepper_queue_move(s, s->last_queued_interval + args[1], args[2], args[3]);
+}
+DECL_COMMAND_FLAGS(command_queue_step_delta, HF_FAST_PARSE,
+                   "queue_step_delta oid=%c interval_delta=%i count=%hu"
+                   " add=%hi");
 
 // Set the direction of the next queued step
 void
@@ -261,7 +432,8 @@ command_set_next_step_dir(uint32_t *args)
     s->flags = (s->flags & ~SF_NEXT_DIR) | nextdir;
     irq_enable();
 }
-DECL_COMMAND(command_set_next_step_dir, "set_next_step_dir oid=%c dir=%c");
+DECL_COMMAND_FLAGS(command_set_next_step_dir, HF_FAST_PARSE,
+                   "set_next_step_dir oid=%c dir=%c");
 
 // Set an absolute time that the next step will be relative to
 void
@@ -270,7 +442,7 @@ command_reset_step_clock(uint32_t *args)
     struct stepper *s = stepper_oid_lookup(args[0]);
     uint32_t waketime = args[1];
     irq_disable();
-    if (s->count)
+    if (s->count || s->flags & SF_DMA_BUSY)
         shutdown("Can't reset time when stepper active");
     s->next_step_time = s->time.waketime = waketime;
     s->flags &= ~SF_NEED_RESET;
@@ -284,13 +456,17 @@ stepper_get_position(struct stepper *s)
 {
     uint32_t position = s->position;
     // If stepper is mid-move, subtract out steps not yet taken
-    if (HAVE_SINGLE_SCHEDULE && s->flags & SF_SINGLE_SCHED)
+    if ((HAVE_SINGLE_SCHEDULE && s->flags & SF_SINGLE_SCHED)
+        || (CONFIG_STEPPER_DMA && s->dma))
         position -= s->count;
     else
         position -= s->count / 2;
     // The top bit of s->position is an optimized reverse direction flag
     if (position & 0x80000000)
-        return -position;
+        position = -position;
+    if (CONFIG_STEPPER_DMA && s->dma)
+        // Subtract out steps still buffered in hardware
+        position -= stepdma_pending(s->dma);
     return position;
 }
 
@@ -312,9 +488,12 @@ static void
 stepper_stop(struct trsync_signal *tss, uint8_t reason)
 {
     struct stepper *s = container_of(tss, struct stepper, stop_signal);
-    sched_del_timer(&s->time);
+    stepper_del_timer(s);
+    int32_t unsent = 0;
+    if (CONFIG_STEPPER_DMA && s->dma)
+        unsent = stepdma_stop(s->dma);
     s->next_step_time = s->time.waketime = 0;
-    s->position = -stepper_get_position(s);
+    s->position = -(stepper_get_position(s) - unsent);
     s->count = 0;
     s->flags = (s->flags & (SF_INVERT_STEP|SF_SINGLE_SCHED)) | SF_NEED_RESET;
     gpio_out_write(s->dir_pin, 0);
@@ -117,6 +117,9 @@ gpio_adc_setup(uint32_t pin)
         gpio_peripheral(pin, GPIO_ANALOG, 0);
     }
 
+    if (CONFIG_ADC_DMA && adc == ADC1)
+        adc_scan_add(chan);
+
     return (struct gpio_adc){ .adc = adc, .chan = chan };
 }
 
@@ -126,6 +129,8 @@ gpio_adc_setup(uint32_t pin)
 uint32_t
 gpio_adc_sample(struct gpio_adc g)
 {
+    if (CONFIG_ADC_DMA && g.adc == ADC1)
+        return adc_scan_sample(g.chan);
     ADC_TypeDef *adc = g.adc;
     uint32_t sr = adc->SR;
     if (sr & ADC_SR_STRT) {
@@ -147,6 +152,8 @@ need_delay:
 uint16_t
 gpio_adc_read(struct gpio_adc g)
 {
+    if (CONFIG_ADC_DMA && g.adc == ADC1)
+        return adc_scan_read(g.chan);
     ADC_TypeDef *adc = g.adc;
     adc->SR = ~ADC_SR_STRT;
     return adc->DR;
@@ -156,6 +163,8 @@ gpio_adc_read(struct gpio_adc g)
 void
 gpio_adc_cancel_sample(struct gpio_adc g)
 {
+    if (CONFIG_ADC_DMA && g.adc == ADC1)
+        return;
     ADC_TypeDef *adc = g.adc;
     irqstatus_t flag = irq_save();
     if (adc->SR & ADC_SR_STRT && adc->SQR3 == g.chan)
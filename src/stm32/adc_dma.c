@@ -0,0 +1,101 @@
+// Scanning of all configured ADC1 channels using DMA on STM32F4
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "board/misc.h" // timer_from_us
+#include "command.h" // shutdown
+#include "internal.h" // adc_scan_add
+#include "sched.h" // sched_shutdown
+
+#define ADC_OVERSAMPLE 8        // Conversions averaged for each reading
+#define ADC_SCAN_MAX 16         // Maximum length of the regular sequence
+#define ADC_DMA DMA2_Stream0    // ADC1 is on dma2 stream 0 channel 0
+
+// ADC1 converts the channels in adc_scan_chans (in order) using "scan"
+// and "continuous" modes and dma copies each result into adc_scan_buf.
+static uint16_t adc_scan_buf[ADC_SCAN_MAX * ADC_OVERSAMPLE];
+static uint8_t adc_scan_chans[ADC_SCAN_MAX];
+static uint8_t adc_scan_count, adc_scan_active;
+static uint32_t adc_scan_ready;
+
+// Add a channel to the scan sequence
+void
+adc_scan_add(uint32_t chan)
+{
+    int i;
+    for (i=0; i<adc_scan_count; i++)
+        if (adc_scan_chans[i] == chan)
+            return;
+    if (adc_scan_count >= ADC_SCAN_MAX)
+        shutdown("Too many ADC channels");
+    adc_scan_chans[adc_scan_count++] = chan;
+}
+
+// Start a new scan of all channels
+static uint32_t
+adc_scan_start(void)
+{
+    ADC_TypeDef *adc = ADC1;
+    uint32_t sqr[3] = { (adc_scan_count - 1) << ADC_SQR1_L_Pos, 0, 0 };
+    int i;
+    for (i=0; i<adc_scan_count; i++)
+        sqr[2 - i / 6] |= adc_scan_chans[i] << ((i % 6) * 5);
+    adc->CR2 = ADC_CR2_ADON;
+    adc->SR = 0;
+    adc->CR1 = ADC_CR1_SCAN;
+    adc->SQR1 = sqr[0];
+    adc->SQR2 = sqr[1];
+    adc->SQR3 = sqr[2];
+
+    if (!is_enabled_pclock(DMA2_BASE))
+        enable_pclock(DMA2_BASE);
+    uint32_t count = adc_scan_count * ADC_OVERSAMPLE;
+    DMA2->LIFCR = (DMA_LIFCR_CTCIF0 | DMA_LIFCR_CHTIF0 | DMA_LIFCR_CTEIF0
+                   | DMA_LIFCR_CDMEIF0 | DMA_LIFCR_CFEIF0);
+    ADC_DMA->PAR = (uint32_t)&adc->DR;
+    ADC_DMA->M0AR = (uint32_t)adc_scan_buf;
+    ADC_DMA->NDTR = count;
+    ADC_DMA->CR = (DMA_SxCR_MSIZE_0 | DMA_SxCR_PSIZE_0 | DMA_SxCR_MINC
+                   | DMA_SxCR_EN);
+
+    adc->CR2 = ADC_CR2_ADON | ADC_CR2_CONT | ADC_CR2_DMA;
+    adc->CR2 = ADC_CR2_ADON | ADC_CR2_CONT | ADC_CR2_DMA | ADC_CR2_SWSTART;
+    adc_scan_active = 1;
+    adc_scan_ready = 0;
+    return timer_from_us(5 * count + 10); // Each conversion takes ~4.5us
+}
+
+// Check if a reading for the channel is available from a completed
+// scan (starting a new scan if not). Returns zero if the reading is
+// ready, otherwise the number of clock ticks to wait before retrying.
+uint32_t
+adc_scan_sample(uint32_t chan)
+{
+    if (adc_scan_active) {
+        if (ADC_DMA->CR & DMA_SxCR_EN)
+            // Scan still in progress
+            return timer_from_us(20);
+        ADC1->CR2 = ADC_CR2_ADON;
+        adc_scan_active = 0;
+        adc_scan_ready = ~0;
+    }
+    if (adc_scan_ready & (1 << chan))
+        return 0;
+    return adc_scan_start();
+}
+
+// Return the average of the channel's conversions in the last scan
+uint16_t
+adc_scan_read(uint32_t chan)
+{
+    adc_scan_ready &= ~(1 << chan);
+    uint32_t pos = 0;
+    while (adc_scan_chans[pos] != chan)
+        pos++;
+    uint32_t i, sum = 0;
+    for (i=0; i<ADC_OVERSAMPLE; i++)
+        sum += adc_scan_buf[i * adc_scan_count + pos];
+    return (sum + ADC_OVERSAMPLE / 2) / ADC_OVERSAMPLE;
+}
@@ -0,0 +1,107 @@
+// Pin change interrupts using the EXTI controller on STM32F4
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <string.h> // ffs, memset
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/gpioirq.h" // gpio_irq_setup
+#include "board/irq.h" // irq_save
+#include "board/misc.h" // timer_read_time
+#include "internal.h" // enable_pclock
+#include "sched.h" // DECL_SHUTDOWN
+
+// There is one exti line per pin number (shared by all gpio ports)
+static struct gpio_irq *exti_irqs[16];
+
+// Disable a pin change interrupt (and discard any pending edge)
+void
+gpio_irq_disable(struct gpio_irq *gi)
+{
+    uint32_t bit = GPIO2BIT(gi->pin);
+    irqstatus_t flag = irq_save();
+    EXTI->IMR &= ~bit;
+    EXTI->PR = bit;
+    irq_restore(flag);
+}
+
+// Invoke the callback (once) on the next rising or falling edge
+void
+gpio_irq_enable(struct gpio_irq *gi, uint_fast8_t rising)
+{
+    uint32_t bit = GPIO2BIT(gi->pin);
+    irqstatus_t flag = irq_save();
+    EXTI->PR = bit;
+    if (rising) {
+        EXTI->FTSR &= ~bit;
+        EXTI->RTSR |= bit;
+    } else {
+        EXTI->RTSR &= ~bit;
+        EXTI->FTSR |= bit;
+    }
+    EXTI->IMR |= bit;
+    irq_restore(flag);
+}
+
+// Main pin change irq handler
+void
+EXTI_IRQHandler(void)
+{
+    uint32_t time = timer_read_time();
+    uint32_t pending = EXTI->PR & EXTI->IMR;
+    while (pending) {
+        uint32_t line = ffs(pending) - 1;
+        pending &= pending - 1;
+        struct gpio_irq *gi = exti_irqs[line];
+        gpio_irq_disable(gi);
+        gi->func(gi, time);
+    }
+}
+
+// Register a pin for pin change interrupts (returns -1 if not available)
+int
+gpio_irq_setup(struct gpio_irq *gi, uint32_t pin)
+{
+    uint32_t line = pin % 16;
+    if (exti_irqs[line])
+        return -1;
+    gi->pin = pin;
+    exti_irqs[line] = gi;
+    gpio_irq_disable(gi);
+
+    if (!is_enabled_pclock(SYSCFG_BASE))
+        enable_pclock(SYSCFG_BASE);
+    uint32_t shift = (line % 4) * 4;
+    irqstatus_t flag = irq_save();
+    SYSCFG->EXTICR[line / 4] = ((SYSCFG->EXTICR[line / 4] & ~(0xf << shift))
+                                | (GPIO2PORT(pin) << shift));
+    irq_restore(flag);
+
+    armcm_enable_irq(EXTI_IRQHandler, EXTI0_IRQn, 1);
+    armcm_enable_irq(EXTI_IRQHandler, EXTI1_IRQn, 1);
+    armcm_enable_irq(EXTI_IRQHandler, EXTI2_IRQn, 1);
+    armcm_enable_irq(EXTI_IRQHandler, EXTI3_IRQn, 1);
+    armcm_enable_irq(EXTI_IRQHandler, EXTI4_IRQn, 1);
+    armcm_enable_irq(EXTI_IRQHandler, EXTI9_5_IRQn, 1);
+    armcm_enable_irq(EXTI_IRQHandler, EXTI15_10_IRQn, 1);
+    return 0;
+}
+
+// Disable all pin change interrupts (their handlers stay registered)
+void
+gpio_irq_shutdown(void)
+{
+    int i;
+    for (i=0; i<ARRAY_SIZE(exti_irqs); i++)
+        if (exti_irqs[i])
+            gpio_irq_disable(exti_irqs[i]);
+}
+DECL_SHUTDOWN(gpio_irq_shutdown);
+
+// Forget all registered handlers - called from config_reset()
+void
+gpio_irq_reset(void)
+{
+    memset(exti_irqs, 0, sizeof(exti_irqs));
+}
@@ -39,6 +39,11 @@ extern GPIO_TypeDef * const digital_regs[];
 #define GPIO_ANALOG 3
 void gpio_peripheral(uint32_t gpio, uint32_t mode, int pullup);
 
+// adc_dma.c
+void adc_scan_add(uint32_t chan);
+uint32_t adc_scan_sample(uint32_t chan);
+uint16_t adc_scan_read(uint32_t chan);
+
 // clockline.c
 void enable_pclock(uint32_t periph_base);
 int is_enabled_pclock(uint32_t periph_base);
@@ -4,6 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_STEPPER_TIMERS
 #include "board/armcm_boot.h" // armcm_enable_irq
 #include "board/armcm_timer.h" // udelay
 #include "board/internal.h" // TIM3
@@ -45,7 +46,7 @@ static inline void
 timer_set(uint32_t next)
 {
     TIMx->CCR1 = next;
-    TIMx->SR = 0;
+    TIMx->SR = ~TIM_SR_CC1IF;
 }
 
 // Activate timer dispatch as soon as possible
@@ -98,6 +99,83 @@ timer_reset(void)
 DECL_SHUTDOWN(timer_reset);
 
 
+/****************************************************************
+ * Dedicated timer channels
+ ****************************************************************/
+
+// Compare channels 2-4 of a 32bit timer may be assigned to individual
+// timers (eg, steppers)
+#define NUM_CHANNELS (HAVE_TIMER_32BIT ? 3 : 0)
+
+static struct timer *channel_timers[3];
+
+static inline volatile uint32_t *
+channel_ccr(uint32_t chan)
+{
+    return &(&TIMx->CCR1)[chan + 1];
+}
+
+// Dispatch the timers of all channels with a pending compare event
+static void
+channel_dispatch(uint32_t sr)
+{
+    uint32_t chan;
+    for (chan=0; chan<NUM_CHANNELS; chan++) {
+        uint32_t bit = TIM_SR_CC2IF << chan;
+        if (!(sr & bit))
+            continue;
+        TIMx->SR = ~bit;
+        uint32_t next;
+        if (timer_dispatch_channel(channel_timers[chan], &next))
+            *channel_ccr(chan) = next;
+        else
+            TIMx->DIER &= ~(TIM_DIER_CC2IE << chan);
+    }
+}
+
+// Assign a timer to a free channel (returns -1 if none available)
+int8_t
+timer_channel_alloc(struct timer *t)
+{
+    int i;
+    for (i=0; i<NUM_CHANNELS; i++) {
+        if (channel_timers[i])
+            continue;
+        channel_timers[i] = t;
+        return i;
+    }
+    return -1;
+}
+
+// Schedule the timer assigned to a channel (caller must disable irqs)
+void
+timer_channel_add(uint8_t chan)
+{
+    *channel_ccr(chan) = timer_channel_start(channel_timers[chan]);
+    TIMx->SR = ~(TIM_SR_CC2IF << chan);
+    TIMx->DIER |= TIM_DIER_CC2IE << chan;
+}
+
+// Cancel the timer assigned to a channel (caller must disable irqs)
+void
+timer_channel_del(uint8_t chan)
+{
+    TIMx->DIER &= ~(TIM_DIER_CC2IE << chan);
+    TIMx->SR = ~(TIM_SR_CC2IF << chan);
+}
+
+// Release all channels
+void
+timer_channel_reset(void)
+{
+    int i;
+    for (i=0; i<NUM_CHANNELS; i++) {
+        timer_channel_del(i);
+        channel_timers[i] = NULL;
+    }
+}
+
+
 /****************************************************************
  * Setup and irqs
  ****************************************************************/
@@ -107,6 +185,14 @@ void __aligned(16)
 TIMx_IRQHandler(void)
 {
     irq_disable();
+    if (CONFIG_STEPPER_TIMERS && NUM_CHANNELS) {
+        uint32_t sr = TIMx->SR & TIMx->DIER;
+        channel_dispatch(sr);
+        if (!(sr & TIM_SR_CC1IF)) {
+            irq_enable();
+            return;
+        }
+    }
     uint32_t next = timer_dispatch_many();
     timer_set(next);
     irq_enable();
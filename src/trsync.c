@@ -163,7 +163,7 @@ command_trsync_trigger(uint32_t *args)
     ts->flags = 0;
     uint8_t trigger_reason = ts->trigger_reason;
     irq_enable();
-    trsync_report(oid, 0, trigger_reason, 0);
+    trsync_report(oid, 0, trigger_reason, timer_read_time());
 }
 DECL_COMMAND(command_trsync_trigger, "trsync_trigger oid=%c reason=%c");
 